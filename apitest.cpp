@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <string>
+#include <thread>
+#include "smtsampler.h"
+
+// Tests of the Sampler API of libsmtsampler.a, on small formulas written
+// next to the test.
+
+static const char * formula_file = "apitest.smt2";
+
+void write_formula(char const * text) {
+    FILE * f = fopen(formula_file, "w");
+    fputs(text, f);
+    fclose(f);
+}
+
+// stats() from the program taking the samples, while the samplers wait for
+// it to take some: it must not wait for them in turn.
+bool stats_with_full_queue() {
+    write_formula("(declare-const x (_ BitVec 16))\n"
+                  "(declare-const y (_ BitVec 16))\n"
+                  "(assert (bvult x y))\n");
+    Options o;
+    o.max_samples = 100000;
+    o.max_time = 60.0;
+    o.has_seed = true;
+    o.seed = 1;
+    Sampler s(formula_file, o);
+    if (!s.start()) {
+        std::cout << "stats_with_full_queue: " << s.error() << '\n';
+        return false;
+    }
+    // The queue holds 1024 samples; once that many are valid, the samplers
+    // are left waiting to push the next one.
+    for (int i = 0; i < 300 && s.valid_samples() < 1024; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    std::future<SamplerStats> stats = std::async(std::launch::async, [&s] { return s.stats(); });
+    if (stats.wait_for(std::chrono::seconds(10)) != std::future_status::ready) {
+        std::cout << "stats_with_full_queue: stats() blocked\n";
+        fflush(stdout);
+        _exit(1);
+    }
+    stats.get();
+    Sample sample;
+    int taken = 0;
+    while (taken < 2000 && s.next(sample))
+        ++taken;
+    s.cancel();
+    if (taken < 2000) {
+        std::cout << "stats_with_full_queue: only " << taken << " samples\n";
+        return false;
+    }
+    return true;
+}
+
+int count_lines(std::string const & name) {
+    FILE * f = fopen(name.c_str(), "r");
+    if (!f)
+        return 0;
+    int lines = 0;
+    int ch;
+    while ((ch = fgetc(f)) != EOF)
+        lines += ch == '\n';
+    fclose(f);
+    return lines;
+}
+
+// A run resumed with the seed of the checkpointed run must not replay its
+// epochs: the valid samples it adds should be mostly new.
+bool resume_with_seed() {
+    write_formula("(declare-const x (_ BitVec 32))\n"
+                  "(declare-const y (_ BitVec 32))\n"
+                  "(assert (bvult x y))\n");
+    std::string samples = std::string(formula_file) + ".samples";
+    std::string checkpoint = std::string(formula_file) + ".checkpoint";
+    remove(checkpoint.c_str());
+    Options o;
+    o.quiet = true;
+    o.max_samples = 2000;
+    o.has_seed = true;
+    o.seed = 7;
+    o.checkpoint = 1000.0;
+    // -n is only checked between solver calls, and every combination of
+    // this formula is valid.
+    o.combine_budget = 500;
+    int valid;
+    {
+        Sampler s(formula_file, o);
+        if (!s.write_samples()) {
+            std::cout << "resume_with_seed: " << s.error() << '\n';
+            return false;
+        }
+        valid = s.valid_samples();
+    }
+    int before = count_lines(samples);
+    o.resume = true;
+    o.max_samples = valid + 2000;
+    {
+        Sampler s(formula_file, o);
+        if (!s.write_samples()) {
+            std::cout << "resume_with_seed: " << s.error() << '\n';
+            return false;
+        }
+    }
+    int added = count_lines(samples) - before;
+    remove(samples.c_str());
+    remove(checkpoint.c_str());
+    if (added < 1000) {
+        std::cout << "resume_with_seed: only " << added << " new unique samples of 2000\n";
+        return false;
+    }
+    return true;
+}
+
+int main() {
+    int failures = 0;
+    failures += !stats_with_full_queue();
+    failures += !resume_with_seed();
+    remove(formula_file);
+    std::cout << (failures ? "FAILED\n" : "OK\n");
+    return failures > 0;
+}
@@ -0,0 +1,188 @@
+#!/usr/bin/env python3
+"""Runs smtsampler over a directory of .smt2 formulas and records one CSV
+row per formula, or compares such a CSV with a baseline.
+
+  bench.py run DIR [--out bench.csv] [--time 60] [--samples 1000000]
+               [--seed 1] [--sampler ./smtsampler] [-- sampler options]
+  bench.py compare BASELINE CURRENT [--tolerance 0.1]
+
+Each formula is sampled in a scratch directory, with --stats-json polled
+every second to follow the growth of coverage. compare prints every
+formula whose throughput fell, or whose peak memory grew, by more than the
+tolerance, and exits with status 1 if there is any.
+"""
+
+import argparse
+import csv
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+FIELDS = [
+    'formula', 'seed', 'time_limit', 'max_samples', 'elapsed',
+    'samples', 'valid_samples', 'unique_samples',
+    'samples_per_sec', 'unique_per_sec',
+    'accuracy_2', 'accuracy_3', 'accuracy_4', 'accuracy_5', 'accuracy_6',
+    'coverage_25', 'coverage_50', 'coverage_75', 'coverage_100',
+    'solve_p50', 'solve_p99', 'peak_rss_kb',
+]
+
+# Metrics compared by compare, with whether higher is better.
+METRICS = [
+    ('samples_per_sec', True),
+    ('unique_per_sec', True),
+    ('peak_rss_kb', False),
+]
+
+
+def read_stats(path):
+    try:
+        with open(path) as f:
+            return json.load(f)
+    except (IOError, ValueError):
+        return None
+
+
+def covered(stats):
+    return stats['coverage']['bool'][0] + stats['coverage']['bv'][0]
+
+
+def run_formula(sampler, formula, args, extra):
+    scratch = tempfile.mkdtemp(prefix='smtbench')
+    try:
+        target = os.path.join(scratch, os.path.basename(formula))
+        os.symlink(os.path.abspath(formula), target)
+        stats_path = os.path.join(scratch, 'stats.json')
+        cmd = [sampler, '-n', str(args.samples), '-t', str(args.time),
+               '--seed', str(args.seed), '--stats-json', stats_path] + extra + [target]
+        start = time.time()
+        with open(os.devnull, 'w') as devnull:
+            proc = subprocess.Popen(cmd, stdout=devnull, stderr=devnull)
+        growth = []
+        while True:
+            pid, status, usage = os.wait4(proc.pid, os.WNOHANG)
+            if pid:
+                break
+            time.sleep(1.0)
+            stats = read_stats(stats_path)
+            if stats:
+                growth.append((stats['elapsed'], covered(stats)))
+        stats = read_stats(stats_path)
+        if not stats or not stats['final']:
+            if os.WIFSIGNALED(status):
+                reason = 'killed by signal %d' % os.WTERMSIG(status)
+            else:
+                reason = 'exit status %d' % os.WEXITSTATUS(status)
+            sys.stderr.write('%s: sampler failed with %s\n' % (formula, reason))
+            return None
+        growth.append((stats['elapsed'], covered(stats)))
+
+        elapsed = stats['elapsed'] or time.time() - start
+        row = {
+            'formula': os.path.basename(formula),
+            'seed': args.seed,
+            'time_limit': args.time,
+            'max_samples': args.samples,
+            'elapsed': '%.3f' % elapsed,
+            'samples': stats['samples'],
+            'valid_samples': stats['valid_samples'],
+            'unique_samples': stats['unique_samples'],
+            'samples_per_sec': '%.1f' % (stats['samples'] / elapsed),
+            'unique_per_sec': '%.1f' % (stats['unique_samples'] / elapsed),
+            'solve_p50': stats['phases']['solve']['p50'],
+            'solve_p99': stats['phases']['solve']['p99'],
+            'peak_rss_kb': usage.ru_maxrss,
+        }
+        for k in range(2, 7):
+            total = stats['combined'][k - 2]
+            good = stats['combined_valid'][k - 2]
+            row['accuracy_%d' % k] = '%.4f' % (float(good) / total) if total else ''
+        for q in (25, 50, 75, 100):
+            at = elapsed * q / 100.0
+            row['coverage_%d' % q] = max([c for t, c in growth if t <= at] or [0])
+        return row
+    finally:
+        shutil.rmtree(scratch, ignore_errors=True)
+
+
+def run(args, extra):
+    formulas = sorted(os.path.join(dp, f) for dp, dn, fn in os.walk(args.dir)
+                      for f in fn if f.endswith('.smt2'))
+    if not formulas:
+        sys.stderr.write('No .smt2 files in %s\n' % args.dir)
+        return 1
+    with open(args.out, 'w') as out:
+        writer = csv.DictWriter(out, FIELDS)
+        writer.writeheader()
+        for formula in formulas:
+            row = run_formula(args.sampler, formula, args, extra)
+            if row:
+                writer.writerow(row)
+                out.flush()
+                print('%s: %s samples/s, %s unique/s, %s KB' % (
+                    row['formula'], row['samples_per_sec'], row['unique_per_sec'], row['peak_rss_kb']))
+    return 0
+
+
+def load(path):
+    with open(path) as f:
+        return dict((row['formula'], row) for row in csv.DictReader(f))
+
+
+def compare(args):
+    baseline = load(args.baseline)
+    current = load(args.current)
+    regressions = 0
+    for formula in sorted(current):
+        if formula not in baseline:
+            continue
+        for metric, higher in METRICS:
+            old = float(baseline[formula][metric])
+            new = float(current[formula][metric])
+            if old <= 0:
+                continue
+            change = (new - old) / old
+            if (-change if higher else change) > args.tolerance:
+                print('REGRESSION %s %s: %g -> %g (%+.1f%%)' % (formula, metric, old, new, 100 * change))
+                regressions += 1
+    missing = sorted(set(baseline) - set(current))
+    for formula in missing:
+        print('MISSING %s' % formula)
+    print('%d regressions, %d formulas missing' % (regressions, len(missing)))
+    return 1 if regressions or missing else 0
+
+
+def main():
+    argv = sys.argv[1:]
+    extra = []
+    if '--' in argv:
+        extra = argv[argv.index('--') + 1:]
+        argv = argv[:argv.index('--')]
+    parser = argparse.ArgumentParser(description='Benchmarks smtsampler.')
+    sub = parser.add_subparsers(dest='command')
+    p = sub.add_parser('run')
+    p.add_argument('dir')
+    p.add_argument('--out', default='bench.csv')
+    p.add_argument('--time', type=float, default=60.0)
+    p.add_argument('--samples', type=int, default=1000000)
+    p.add_argument('--seed', type=int, default=1)
+    p.add_argument('--sampler', default='./smtsampler')
+    p = sub.add_parser('compare')
+    p.add_argument('baseline')
+    p.add_argument('current')
+    p.add_argument('--tolerance', type=float, default=0.1)
+    args = parser.parse_args(argv)
+    if args.command == 'run':
+        return run(args, extra)
+    if args.command == 'compare':
+        return compare(args)
+    parser.print_help()
+    return 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
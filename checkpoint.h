@@ -0,0 +1,140 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "sample.h"
+
+// Snapshot of a run, from which a later run on the same formula resumes:
+//
+//   "SMTCKPv2", then the uint64s hash of the formula file, strategy,
+//   whether the samples file is binary, whether the set of unique samples
+//   is exact, the size of the samples file (records and words of
+//   tables of a binary file, lines and bytes of a text file), samples,
+//   valid samples, epochs, flips, solver calls and unsat flips; the number
+//   of known unsat flips and their (variable, bit) pairs; the number of
+//   coverage snapshots and each as its length and words; and last the set
+//   of unique samples, as written by SampleSet::save().
+#define CHECKPOINT_MAGIC "SMTCKPv2"
+
+struct Checkpoint {
+    uint64_t formula = 0;
+    uint64_t strategy = 0;
+    uint64_t binary = 0;
+    uint64_t exact_dedupe = 0;
+    uint64_t position[2] = {0, 0};
+    uint64_t samples = 0;
+    uint64_t valid_samples = 0;
+    uint64_t epochs = 0;
+    uint64_t flips = 0;
+    uint64_t solver_calls = 0;
+    uint64_t unsat_ind = 0;
+    std::vector<std::pair<int, int>> unsat;
+    std::vector<std::vector<uint64_t>> coverage;
+
+    // Writes the checkpoint next to name and then renames it, so that name
+    // always holds a whole checkpoint.
+    bool save(std::string const & name, SampleSet const & set) const {
+        std::string tmp = name + ".tmp";
+        FILE * f = fopen(tmp.c_str(), "wb");
+        if (!f)
+            return false;
+        fwrite(CHECKPOINT_MAGIC, 1, 8, f);
+        uint64_t h[12] = { formula, strategy, binary, exact_dedupe, position[0], position[1], samples, valid_samples, epochs, flips, solver_calls, unsat_ind };
+        fwrite(h, sizeof(uint64_t), 12, f);
+        write64(f, unsat.size());
+        for (std::pair<int, int> const & p : unsat) {
+            write64(f, p.first);
+            write64(f, p.second);
+        }
+        write64(f, coverage.size());
+        for (std::vector<uint64_t> const & words : coverage) {
+            write64(f, words.size());
+            fwrite(words.data(), sizeof(uint64_t), words.size(), f);
+        }
+        set.save(f);
+        bool ok = !ferror(f);
+        ok = fclose(f) == 0 && ok;
+        return ok && rename(tmp.c_str(), name.c_str()) == 0;
+    }
+
+    // Reads a checkpoint, adding its samples to set. The header is kept
+    // even if the rest cannot be read; formula stays 0 if it is not.
+    bool load(std::string const & name, SampleSet & set) {
+        FILE * f = fopen(name.c_str(), "rb");
+        if (!f)
+            return false;
+        bool ok = read(f, set);
+        fclose(f);
+        return ok;
+    }
+
+private:
+    static void write64(FILE * f, uint64_t v) {
+        fwrite(&v, sizeof(uint64_t), 1, f);
+    }
+
+    static bool read64(FILE * f, uint64_t & v) {
+        return fread(&v, sizeof(uint64_t), 1, f) == 1;
+    }
+
+    bool read(FILE * f, SampleSet & set) {
+        char magic[8];
+        if (fread(magic, 1, 8, f) != 8 || memcmp(magic, CHECKPOINT_MAGIC, 8))
+            return false;
+        uint64_t h[12];
+        if (fread(h, sizeof(uint64_t), 12, f) != 12)
+            return false;
+        formula = h[0];
+        strategy = h[1];
+        binary = h[2];
+        exact_dedupe = h[3];
+        position[0] = h[4];
+        position[1] = h[5];
+        samples = h[6];
+        valid_samples = h[7];
+        epochs = h[8];
+        flips = h[9];
+        solver_calls = h[10];
+        unsat_ind = h[11];
+        uint64_t n, a, b;
+        if (!read64(f, n))
+            return false;
+        for (uint64_t i = 0; i < n; ++i) {
+            if (!read64(f, a) || !read64(f, b))
+                return false;
+            unsat.emplace_back(a, b);
+        }
+        if (!read64(f, n))
+            return false;
+        for (uint64_t i = 0; i < n; ++i) {
+            if (!read64(f, a))
+                return false;
+            coverage.emplace_back(a);
+            if (fread(coverage.back().data(), sizeof(uint64_t), a, f) != a)
+                return false;
+        }
+        return set.load(f);
+    }
+};
+
+// FNV-1a hash of the contents of a file, or 0 if it cannot be read.
+inline uint64_t file_hash(std::string const & name) {
+    FILE * f = fopen(name.c_str(), "rb");
+    if (!f)
+        return 0;
+    uint64_t h = 0xcbf29ce484222325ull;
+    unsigned char buffer[1 << 16];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+        for (size_t i = 0; i < n; ++i)
+            h = (h ^ buffer[i]) * 0x100000001b3ull;
+    }
+    fclose(f);
+    return h;
+}
+
+#endif
@@ -0,0 +1,230 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include <z3++.h>
+#include "evaluator.h"
+
+// Differential test of Evaluator against z3: for every operator, compiles
+// (= t r) where r is a variable of the sort of the term t, and checks random
+// samples both with r set to z3's value of t, which must hold, and with r
+// set to another value, which must not.
+
+std::mt19937_64 rng(1);
+
+// Random values biased towards the cases operators treat apart: zero, all
+// ones, the sign bit alone and amounts around the width.
+void random_value(uint64_t * r, bool is_bool, unsigned width) {
+    unsigned n = SampleLayout::nwords(width);
+    if (is_bool) {
+        r[0] = rng() & 1;
+        return;
+    }
+    for (unsigned k = 0; k < n; ++k)
+        r[k] = 0;
+    switch (rng() % 6) {
+    case 0:
+        break;
+    case 1:
+        for (unsigned k = 0; k < n; ++k)
+            r[k] = ~0ull;
+        break;
+    case 2:
+        r[(width - 1) / 64] = 1ull << ((width - 1) % 64);
+        break;
+    case 3:
+        r[0] = rng() % (2 * width + 2);
+        break;
+    default:
+        for (unsigned k = 0; k < n; ++k)
+            r[k] = rng();
+    }
+    r[n - 1] &= SampleLayout::top_mask(width);
+}
+
+z3::expr value(z3::context & c, uint64_t const * v, z3::sort s) {
+    if (s.is_bool())
+        return c.bool_val(v[0] != 0);
+    unsigned width = s.bv_size();
+    z3::expr e = c.bv_val((uint64_t)v[0], std::min(width, 64u));
+    for (unsigned k = 1; k < SampleLayout::nwords(width); ++k)
+        e = z3::concat(c.bv_val((uint64_t)v[k], std::min(width - 64 * k, 64u)), e);
+    return e.simplify();
+}
+
+// A random sample of the variables, and the z3 model of the same values.
+Sample random_sample(z3::context & c, SampleLayout const & layout, std::vector<z3::func_decl> & decls, z3::model & m) {
+    Sample s(layout.words, 0);
+    std::vector<uint64_t> a;
+    for (unsigned i = 0; i < decls.size(); ++i) {
+        z3::func_decl & v = decls[i];
+        SampleLayout::Field const & f = layout.fields[i];
+        if (!f.is_table) {
+            a.assign(SampleLayout::nwords(f.width), 0);
+            random_value(a.data(), f.is_bool, f.width);
+            layout.set(s, f, a.data());
+            z3::expr val = value(c, a.data(), v.range());
+            m.add_const_interp(v, val);
+            continue;
+        }
+        // Keys are drawn from a few values only, so that lookups often hit.
+        size_t pos = s.size();
+        unsigned num = rng() % 4;
+        s.resize(pos + 1 + f.val_words, 0);
+        random_value(&s[pos + 1], f.is_bool, f.width);
+        std::vector<std::vector<uint64_t>> keys;
+        while (keys.size() < num) {
+            std::vector<uint64_t> key;
+            for (unsigned k = 0; k < f.arg_width.size(); ++k) {
+                a.assign(SampleLayout::nwords(f.arg_width[k]), 0);
+                a[0] = rng() % 4 & SampleLayout::top_mask(f.arg_width[k]);
+                key.insert(key.end(), a.begin(), a.end());
+            }
+            if (std::find(keys.begin(), keys.end(), key) != keys.end())
+                continue;
+            keys.push_back(key);
+            s.insert(s.end(), key.begin(), key.end());
+            a.assign(f.val_words, 0);
+            random_value(a.data(), f.is_bool, f.width);
+            s.insert(s.end(), a.begin(), a.end());
+        }
+        s[pos] = num;
+        SampleLayout::sort_table(s, f, pos);
+        z3::sort range = f.is_array ? v.range().array_range() : v.range();
+        z3::func_decl fd = v;
+        if (f.is_array) {
+            Z3_sort domain[1] = { v.range().array_domain() };
+            fd = z3::func_decl(c, Z3_mk_fresh_func_decl(c, "k", 1, domain, range));
+        }
+        z3::expr def = value(c, &s[pos + 1], range);
+        z3::func_interp fi = m.add_func_interp(fd, def);
+        size_t e = pos + 1 + f.val_words;
+        for (uint64_t j = 0; j < num; ++j) {
+            z3::expr_vector args(c);
+            for (unsigned k = 0; k < f.arg_width.size(); ++k) {
+                z3::sort d = f.is_array ? v.range().array_domain() : v.domain(k);
+                args.push_back(value(c, &s[e], d));
+                e += SampleLayout::nwords(f.arg_width[k]);
+            }
+            z3::expr val = value(c, &s[e], range);
+            fi.add_entry(args, val);
+            e += f.val_words;
+        }
+        if (f.is_array) {
+            z3::expr array(c, Z3_mk_as_array(c, fd));
+            m.add_const_interp(v, array);
+        }
+    }
+    return s;
+}
+
+// The assertion of a script of one, from what parse_string() gives: an
+// expression with the z3 of the build instructions, as parse_file() in
+// smtsampler.cpp, and a vector of the assertions with later ones.
+z3::expr assertion(z3::expr const & e) {
+    return e.decl().decl_kind() == Z3_OP_AND && e.num_args() == 1 ? e.arg(0) : e;
+}
+
+z3::expr assertion(z3::expr_vector const & v) {
+    return v[0];
+}
+
+std::vector<std::string> terms(unsigned w) {
+    std::string W = std::to_string(w);
+    std::vector<std::string> t = {
+        "x", "(bvnot x)", "(bvand x y)", "(bvor x y)", "(bvxor x y)",
+        "(bvnand x y)", "(bvnor x y)", "(bvxnor x y)", "(bvneg x)",
+        "(bvadd x y)", "(bvsub x y)", "(bvmul x y)",
+        "(bvudiv x y)", "(bvurem x y)", "(bvsdiv x y)", "(bvsrem x y)", "(bvsmod x y)",
+        "(bvshl x y)", "(bvlshr x y)", "(bvashr x y)",
+        "(ext_rotate_left x y)", "(ext_rotate_right x y)",
+        "(bvule x y)", "(bvult x y)", "(bvuge x y)", "(bvugt x y)",
+        "(bvsle x y)", "(bvslt x y)", "(bvsge x y)", "(bvsgt x y)",
+        "(= x y)", "(distinct x y (bvadd x y))", "(ite p x y)",
+        "(and p q)", "(or p q)", "(not p)", "(xor p q)", "(=> p q)", "(= p q)",
+        "(concat x y)", "((_ extract " + std::to_string(w - 1) + " 0) x)",
+        "((_ extract " + std::to_string(w + w / 2) + " " + std::to_string(w / 2) + ") (concat x y))",
+        "((_ zero_extend 5) x)", "((_ sign_extend 70) x)", "((_ repeat 3) x)",
+        "(bvcomp x y)", "(bvredor x)", "(bvredand x)",
+        "(select a i)", "(select (store a i x) j)", "(select (store (store a i x) j y) i)",
+        "(select ((as const (Array (_ BitVec 3) (_ BitVec " + W + "))) x) i)",
+        "(g i p)", "(bvadd (g i p) (g j q))",
+    };
+    for (unsigned k : { 0u, 1u, w - 1, w, w + 3, 2 * w + 1 }) {
+        t.push_back("((_ rotate_left " + std::to_string(k) + ") x)");
+        t.push_back("((_ rotate_right " + std::to_string(k) + ") x)");
+    }
+    return t;
+}
+
+int main(int argc, char ** argv) {
+    int trials = argc > 1 ? atoi(argv[1]) : 200;
+    long checks = 0;
+    int failures = 0;
+    for (unsigned w : { 1u, 5u, 8u, 31u, 63u, 64u, 65u, 100u, 128u, 130u }) {
+        std::string W = std::to_string(w);
+        std::string decls =
+            "(declare-const x (_ BitVec " + W + "))(declare-const y (_ BitVec " + W + "))"
+            "(declare-const p Bool)(declare-const q Bool)"
+            "(declare-const i (_ BitVec 3))(declare-const j (_ BitVec 3))"
+            "(declare-const a (Array (_ BitVec 3) (_ BitVec " + W + ")))"
+            "(declare-fun g ((_ BitVec 3) Bool) (_ BitVec " + W + "))";
+        for (std::string const & term : terms(w)) {
+            z3::context c;
+            z3::expr parsed = assertion(c.parse_string((decls + "(assert (= " + term + " " + term + "))").c_str()));
+            z3::expr t = parsed.arg(0);
+            z3::expr r = c.constant("r", t.get_sort());
+            z3::sort bv = c.bv_sort(w);
+            z3::sort idx = c.bv_sort(3);
+            z3::sort_vector args(c);
+            args.push_back(idx);
+            args.push_back(c.bool_sort());
+            std::vector<z3::func_decl> vars = {
+                c.constant("x", bv).decl(), c.constant("y", bv).decl(),
+                c.bool_const("p").decl(), c.bool_const("q").decl(),
+                c.constant("i", idx).decl(), c.constant("j", idx).decl(),
+                c.constant("a", c.array_sort(idx, bv)).decl(),
+                c.function("g", args, bv), r.decl(),
+            };
+            z3::expr formula = t == r;
+            Evaluator ev;
+            if (!ev.compile(formula, vars)) {
+                std::cout << term << " width " << w << ": unsupported " << ev.unsupported << '\n';
+                ++failures;
+                continue;
+            }
+            SampleLayout layout;
+            layout.init(vars);
+            SampleLayout::Field const & rf = layout.fields.back();
+            std::vector<uint64_t> v(SampleLayout::nwords(rf.width));
+            for (int n = 0; n < trials; ++n) {
+                z3::model m(c);
+                Sample s = random_sample(c, layout, vars, m);
+                z3::expr expected = m.eval(t, true);
+                if (rf.is_bool)
+                    v[0] = expected.is_true();
+                else
+                    SampleLayout::numeral(expected, v.data(), rf.width);
+                layout.set(s, rf, v.data());
+                bool same = ev.check(s);
+                v[0] ^= 1;
+                layout.set(s, rf, v.data());
+                bool other = ev.check(s);
+                checks += 2;
+                if (!same || other) {
+                    v[0] ^= 1;
+                    layout.set(s, rf, v.data());
+                    std::cout << term << " width " << w << ": z3 gives " << expected << " on " << layout.render(s) << '\n';
+                    if (++failures >= 20)
+                        return 1;
+                    break;
+                }
+            }
+        }
+    }
+    std::cout << checks << " checks, " << failures << " failures\n";
+    return failures > 0;
+}
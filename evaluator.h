@@ -0,0 +1,1165 @@
+#ifndef EVALUATOR_H
+#define EVALUATOR_H
+
+#include <z3++.h>
+#include <stdint.h>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include "sample.h"
+
+// Compiled form of a QF_BV / QF_ABV formula. compile() flattens the DAG of
+// the formula into a topologically ordered array of instructions over 64-bit
+// words, so that samples can be checked without creating any z3 objects.
+//
+// Every instruction owns a slot of values: one word for Bools, ceil(width/64)
+// words for bit-vectors and one word for arrays, which holds the index of the
+// instruction that produced the array (a variable, a constant array or a
+// store). select() follows that chain of stores back to its base.
+class Evaluator {
+    enum {
+        OP_VAR,
+        OP_ARRAY_VAR,
+        OP_NUM,
+        OP_ITE,
+        OP_EQ,
+        OP_DISTINCT,
+        OP_AND,
+        OP_OR,
+        OP_NOT,
+        OP_XOR,
+        OP_IMPLIES,
+        OP_BNOT,
+        OP_BAND,
+        OP_BOR,
+        OP_BXOR,
+        OP_BNAND,
+        OP_BNOR,
+        OP_BXNOR,
+        OP_BNEG,
+        OP_BADD,
+        OP_BSUB,
+        OP_BMUL,
+        OP_BUDIV,
+        OP_BUREM,
+        OP_BSDIV,
+        OP_BSREM,
+        OP_BSMOD,
+        OP_BSHL,
+        OP_BLSHR,
+        OP_BASHR,
+        OP_ROTATE_LEFT,
+        OP_ROTATE_RIGHT,
+        OP_EXT_ROTATE_LEFT,
+        OP_EXT_ROTATE_RIGHT,
+        OP_ULEQ,
+        OP_ULT,
+        OP_UGEQ,
+        OP_UGT,
+        OP_SLEQ,
+        OP_SLT,
+        OP_SGEQ,
+        OP_SGT,
+        OP_CONCAT,
+        OP_EXTRACT,
+        OP_ZERO_EXT,
+        OP_SIGN_EXT,
+        OP_REPEAT,
+        OP_BCOMP,
+        OP_BREDOR,
+        OP_BREDAND,
+        OP_SELECT,
+        OP_STORE,
+        OP_CONST_ARRAY,
+        OP_APPLY
+    };
+
+    struct Instr {
+        int op;
+        unsigned width;
+        unsigned words;
+        unsigned dst;
+        unsigned first;
+        unsigned num;
+        unsigned p0;
+        unsigned p1;
+    };
+
+    // Interpretation of an array or uninterpreted function, pointing into
+    // the table of the sample last loaded.
+    struct Table {
+        unsigned key_words;
+        unsigned val_words;
+        uint64_t size;
+        uint64_t const * def;
+        uint64_t const * entries;
+    };
+
+    // How the variables of the sample map to instructions and tables.
+    struct Input {
+        bool is_table;
+        unsigned index;
+    };
+
+    std::vector<Instr> code;
+    std::vector<unsigned> args;
+    std::vector<uint64_t> values;
+    std::vector<Table> tables;
+    std::vector<Input> inputs;
+    SampleLayout layout;
+    std::vector<uint64_t> scratch;
+    std::unordered_map<Z3_ast, unsigned> compiled;
+    std::unordered_map<Z3_func_decl, unsigned> functions;
+    unsigned root = 0;
+    bool ready = false;
+
+public:
+    std::string unsupported;
+
+    // Compiles formula, whose free symbols are variables. Returns false and
+    // sets unsupported if the formula uses anything the evaluator does not
+    // implement.
+    bool compile(z3::expr const & formula, std::vector<z3::func_decl> const & variables) {
+        Z3_context ctx = formula.ctx();
+        layout.init(variables);
+        for (unsigned j = 0; j < variables.size(); ++j) {
+            z3::func_decl const & v = variables[j];
+            SampleLayout::Field const & f = layout.fields[j];
+            Input in;
+            if (f.is_table) {
+                if (v.range().is_array()) {
+                    z3::sort s = v.range();
+                    if (!scalar(s.array_domain()) || !scalar(s.array_range())) {
+                        unsupported = "array sort of " + v.name().str();
+                        return false;
+                    }
+                } else {
+                    for (unsigned i = 0; i < v.arity(); ++i) {
+                        if (!scalar(v.domain(i))) {
+                            unsupported = "domain of " + v.name().str();
+                            return false;
+                        }
+                    }
+                    if (!scalar(v.range())) {
+                        unsupported = "range of " + v.name().str();
+                        return false;
+                    }
+                }
+                Table t;
+                t.key_words = f.key_words;
+                t.val_words = f.val_words;
+                t.size = 0;
+                t.def = NULL;
+                t.entries = NULL;
+                in.is_table = true;
+                in.index = tables.size();
+                tables.push_back(t);
+                functions[v] = in.index;
+                if (v.range().is_array()) {
+                    Z3_ast ast = v();
+                    unsigned i = emit(OP_ARRAY_VAR, 64, 0, 0);
+                    code[i].p0 = in.index;
+                    values[code[i].dst] = i;
+                    compiled[ast] = i;
+                }
+            } else {
+                if (!scalar(v.range())) {
+                    unsupported = "sort of " + v.name().str();
+                    return false;
+                }
+                in.is_table = false;
+                in.index = emit(OP_VAR, width(v.range()), 0, 0);
+                compiled[v()] = in.index;
+            }
+            inputs.push_back(in);
+        }
+        std::vector<std::pair<Z3_ast, bool>> todo;
+        todo.emplace_back(formula, false);
+        while (!todo.empty()) {
+            Z3_ast ast = todo.back().first;
+            bool expanded = todo.back().second;
+            if (compiled.find(ast) != compiled.end()) {
+                todo.pop_back();
+                continue;
+            }
+            if (Z3_get_ast_kind(ctx, ast) != Z3_APP_AST && Z3_get_ast_kind(ctx, ast) != Z3_NUMERAL_AST) {
+                unsupported = "quantifier or variable";
+                return false;
+            }
+            Z3_app app = Z3_to_app(ctx, ast);
+            unsigned n = Z3_get_app_num_args(ctx, app);
+            if (!expanded) {
+                todo.back().second = true;
+                for (unsigned i = n; i > 0; --i) {
+                    Z3_ast arg = Z3_get_app_arg(ctx, app, i - 1);
+                    if (compiled.find(arg) == compiled.end())
+                        todo.emplace_back(arg, false);
+                }
+                continue;
+            }
+            todo.pop_back();
+            if (!compile_app(z3::expr(formula.ctx(), ast)))
+                return false;
+        }
+        root = compiled[formula];
+        compiled.clear();
+        scratch.resize(8 * max_words() + 8);
+        ready = true;
+        return true;
+    }
+
+    bool ok() const {
+        return ready;
+    }
+
+    // Loads the values of a sample of the variables. Tables are not copied,
+    // so sample must outlive the evaluation.
+    void load(Sample const & sample) {
+        size_t pos = layout.words;
+        for (unsigned j = 0; j < inputs.size(); ++j) {
+            Input const & in = inputs[j];
+            SampleLayout::Field const & f = layout.fields[j];
+            if (!in.is_table) {
+                layout.get(sample, f, &values[code[in.index].dst]);
+                continue;
+            }
+            Table & t = tables[in.index];
+            t.size = sample[pos];
+            t.def = &sample[pos + 1];
+            t.entries = &sample[pos + 1 + f.val_words];
+            pos += SampleLayout::table_size(f, t.size);
+        }
+    }
+
+    // Evaluates the formula on the sample last loaded.
+    bool eval() {
+        for (unsigned i = 0; i < code.size(); ++i) {
+            step(code[i]);
+        }
+        return values[code[root].dst] != 0;
+    }
+
+    bool check(Sample const & sample) {
+        load(sample);
+        return eval();
+    }
+
+private:
+    static unsigned nwords(unsigned width) {
+        return SampleLayout::nwords(width);
+    }
+
+    static uint64_t top_mask(unsigned width) {
+        return SampleLayout::top_mask(width);
+    }
+
+    static bool scalar(z3::sort const & s) {
+        return s.is_bool() || s.is_bv();
+    }
+
+    static unsigned width(z3::sort const & s) {
+        if (s.is_bv())
+            return s.bv_size();
+        if (s.is_bool())
+            return 1;
+        return 64;
+    }
+
+    unsigned max_words() {
+        unsigned m = 1;
+        for (Instr const & i : code)
+            if (i.words > m)
+                m = i.words;
+        for (Table const & t : tables)
+            if (t.key_words > m)
+                m = t.key_words;
+        return m;
+    }
+
+    unsigned emit(int op, unsigned width, unsigned first, unsigned num) {
+        Instr i;
+        i.op = op;
+        i.width = width;
+        i.words = nwords(width);
+        i.dst = values.size();
+        i.first = first;
+        i.num = num;
+        i.p0 = 0;
+        i.p1 = 0;
+        values.resize(values.size() + i.words, 0);
+        code.push_back(i);
+        return code.size() - 1;
+    }
+
+    bool compile_app(z3::expr const & e) {
+        Z3_context ctx = e.ctx();
+        z3::func_decl d = e.decl();
+        unsigned n = e.num_args();
+        z3::sort s = e.get_sort();
+        if (!scalar(s) && !s.is_array()) {
+            unsupported = "sort of " + d.name().str();
+            return false;
+        }
+        int op;
+        switch (d.decl_kind()) {
+        case Z3_OP_TRUE:
+        case Z3_OP_FALSE:
+        case Z3_OP_BNUM:
+        case Z3_OP_BIT1:
+        case Z3_OP_BIT0:
+        {
+            unsigned i = emit(OP_NUM, width(s), 0, 0);
+            numeral(e, &values[code[i].dst]);
+            compiled[e] = i;
+            return true;
+        }
+        case Z3_OP_UNINTERPRETED:
+        {
+            auto f = functions.find(d);
+            if (n == 0 || f == functions.end()) {
+                unsupported = "free symbol " + d.name().str();
+                return false;
+            }
+            op = OP_APPLY;
+            break;
+        }
+        case Z3_OP_ITE: op = OP_ITE; break;
+        case Z3_OP_EQ:
+        case Z3_OP_IFF: op = OP_EQ; break;
+        case Z3_OP_DISTINCT: op = OP_DISTINCT; break;
+        case Z3_OP_AND: op = OP_AND; break;
+        case Z3_OP_OR: op = OP_OR; break;
+        case Z3_OP_NOT: op = OP_NOT; break;
+        case Z3_OP_XOR: op = OP_XOR; break;
+        case Z3_OP_IMPLIES: op = OP_IMPLIES; break;
+        case Z3_OP_BNOT: op = OP_BNOT; break;
+        case Z3_OP_BAND: op = OP_BAND; break;
+        case Z3_OP_BOR: op = OP_BOR; break;
+        case Z3_OP_BXOR: op = OP_BXOR; break;
+        case Z3_OP_BNAND: op = OP_BNAND; break;
+        case Z3_OP_BNOR: op = OP_BNOR; break;
+        case Z3_OP_BXNOR: op = OP_BXNOR; break;
+        case Z3_OP_BNEG: op = OP_BNEG; break;
+        case Z3_OP_BADD: op = OP_BADD; break;
+        case Z3_OP_BSUB: op = OP_BSUB; break;
+        case Z3_OP_BMUL: op = OP_BMUL; break;
+        case Z3_OP_BUDIV:
+        case Z3_OP_BUDIV_I: op = OP_BUDIV; break;
+        case Z3_OP_BUREM:
+        case Z3_OP_BUREM_I: op = OP_BUREM; break;
+        case Z3_OP_BSDIV:
+        case Z3_OP_BSDIV_I: op = OP_BSDIV; break;
+        case Z3_OP_BSREM:
+        case Z3_OP_BSREM_I: op = OP_BSREM; break;
+        case Z3_OP_BSMOD:
+        case Z3_OP_BSMOD_I: op = OP_BSMOD; break;
+        case Z3_OP_BSHL: op = OP_BSHL; break;
+        case Z3_OP_BLSHR: op = OP_BLSHR; break;
+        case Z3_OP_BASHR: op = OP_BASHR; break;
+        case Z3_OP_ROTATE_LEFT: op = OP_ROTATE_LEFT; break;
+        case Z3_OP_ROTATE_RIGHT: op = OP_ROTATE_RIGHT; break;
+        case Z3_OP_EXT_ROTATE_LEFT: op = OP_EXT_ROTATE_LEFT; break;
+        case Z3_OP_EXT_ROTATE_RIGHT: op = OP_EXT_ROTATE_RIGHT; break;
+        case Z3_OP_ULEQ: op = OP_ULEQ; break;
+        case Z3_OP_ULT: op = OP_ULT; break;
+        case Z3_OP_UGEQ: op = OP_UGEQ; break;
+        case Z3_OP_UGT: op = OP_UGT; break;
+        case Z3_OP_SLEQ: op = OP_SLEQ; break;
+        case Z3_OP_SLT: op = OP_SLT; break;
+        case Z3_OP_SGEQ: op = OP_SGEQ; break;
+        case Z3_OP_SGT: op = OP_SGT; break;
+        case Z3_OP_CONCAT: op = OP_CONCAT; break;
+        case Z3_OP_EXTRACT: op = OP_EXTRACT; break;
+        case Z3_OP_ZERO_EXT: op = OP_ZERO_EXT; break;
+        case Z3_OP_SIGN_EXT: op = OP_SIGN_EXT; break;
+        case Z3_OP_REPEAT: op = OP_REPEAT; break;
+        case Z3_OP_BCOMP: op = OP_BCOMP; break;
+        case Z3_OP_BREDOR: op = OP_BREDOR; break;
+        case Z3_OP_BREDAND: op = OP_BREDAND; break;
+        case Z3_OP_SELECT: op = OP_SELECT; break;
+        case Z3_OP_STORE: op = OP_STORE; break;
+        case Z3_OP_CONST_ARRAY: op = OP_CONST_ARRAY; break;
+        default:
+            unsupported = "operator " + d.name().str();
+            return false;
+        }
+        if ((op == OP_EQ || op == OP_DISTINCT) && !scalar(e.arg(0).get_sort())) {
+            unsupported = "equality between arrays";
+            return false;
+        }
+        if ((op == OP_SELECT || op == OP_STORE) && n != (op == OP_SELECT ? 2 : 3)) {
+            unsupported = "multi-dimensional array";
+            return false;
+        }
+        unsigned first = args.size();
+        for (unsigned i = 0; i < n; ++i) {
+            args.push_back(compiled[e.arg(i)]);
+        }
+        unsigned i = emit(op, width(s), first, n);
+        Instr & in = code[i];
+        switch (op) {
+        case OP_EXTRACT:
+            in.p0 = Z3_get_decl_int_parameter(ctx, d, 0);
+            in.p1 = Z3_get_decl_int_parameter(ctx, d, 1);
+            break;
+        case OP_ROTATE_LEFT:
+        case OP_ROTATE_RIGHT:
+            in.p0 = Z3_get_decl_int_parameter(ctx, d, 0) % in.width;
+            break;
+        case OP_APPLY:
+            in.p0 = functions[d];
+            break;
+        }
+        compiled[e] = i;
+        return true;
+    }
+
+    static void numeral(z3::expr const & e, uint64_t * r) {
+        if (e.is_bool()) {
+            r[0] = e.decl().decl_kind() == Z3_OP_TRUE;
+            return;
+        }
+        SampleLayout::numeral(e, r, e.get_sort().bv_size());
+    }
+
+    uint64_t * val(unsigned arg) {
+        return &values[code[args[arg]].dst];
+    }
+
+    Instr const & operand(Instr const & in, unsigned i) {
+        return code[args[in.first + i]];
+    }
+
+    static bool is_zero(uint64_t const * a, unsigned n) {
+        for (unsigned k = 0; k < n; ++k)
+            if (a[k])
+                return false;
+        return true;
+    }
+
+    static bool equal(uint64_t const * a, uint64_t const * b, unsigned n) {
+        for (unsigned k = 0; k < n; ++k)
+            if (a[k] != b[k])
+                return false;
+        return true;
+    }
+
+    static bool bit(uint64_t const * a, unsigned i) {
+        return (a[i / 64] >> (i % 64)) & 1;
+    }
+
+    static bool sign(uint64_t const * a, unsigned width) {
+        return bit(a, width - 1);
+    }
+
+    static int compare(uint64_t const * a, uint64_t const * b, unsigned n) {
+        for (unsigned k = n; k > 0; --k) {
+            if (a[k - 1] != b[k - 1])
+                return a[k - 1] < b[k - 1] ? -1 : 1;
+        }
+        return 0;
+    }
+
+    static int scompare(uint64_t const * a, uint64_t const * b, unsigned width) {
+        bool sa = sign(a, width);
+        bool sb = sign(b, width);
+        if (sa != sb)
+            return sa ? -1 : 1;
+        return compare(a, b, nwords(width));
+    }
+
+    static void copy(uint64_t * r, uint64_t const * a, unsigned n) {
+        for (unsigned k = 0; k < n; ++k)
+            r[k] = a[k];
+    }
+
+    static void add(uint64_t * r, uint64_t const * a, uint64_t const * b, unsigned n) {
+        uint64_t carry = 0;
+        for (unsigned k = 0; k < n; ++k) {
+            uint64_t s = a[k] + carry;
+            carry = s < carry;
+            r[k] = s + b[k];
+            carry += r[k] < s;
+        }
+    }
+
+    static void sub(uint64_t * r, uint64_t const * a, uint64_t const * b, unsigned n) {
+        uint64_t borrow = 0;
+        for (unsigned k = 0; k < n; ++k) {
+            uint64_t d = a[k] - b[k];
+            uint64_t nb = a[k] < b[k];
+            r[k] = d - borrow;
+            nb |= d < borrow;
+            borrow = nb;
+        }
+    }
+
+    static void neg(uint64_t * r, uint64_t const * a, unsigned width) {
+        unsigned n = nwords(width);
+        uint64_t carry = 1;
+        for (unsigned k = 0; k < n; ++k) {
+            r[k] = ~a[k] + carry;
+            carry = carry && r[k] == 0;
+        }
+        r[n - 1] &= top_mask(width);
+    }
+
+    static void mul(uint64_t * r, uint64_t const * a, uint64_t const * b, unsigned n, uint64_t * t) {
+        if (n == 1) {
+            r[0] = a[0] * b[0];
+            return;
+        }
+        for (unsigned k = 0; k < n; ++k)
+            t[k] = 0;
+        for (unsigned i = 0; i < n; ++i) {
+            uint64_t carry = 0;
+            for (unsigned j = 0; i + j < n; ++j) {
+                unsigned __int128 p = (unsigned __int128)a[i] * b[j] + t[i + j] + carry;
+                t[i + j] = (uint64_t)p;
+                carry = p >> 64;
+            }
+        }
+        copy(r, t, n);
+    }
+
+    // Unsigned division with the SMT-LIB semantics for a zero divisor.
+    static void udivrem(uint64_t * q, uint64_t * r, uint64_t const * a, uint64_t const * b, unsigned width) {
+        unsigned n = nwords(width);
+        if (is_zero(b, n)) {
+            for (unsigned k = 0; k < n; ++k)
+                q[k] = ~0ull;
+            q[n - 1] &= top_mask(width);
+            copy(r, a, n);
+            return;
+        }
+        if (n == 1) {
+            uint64_t x = a[0];
+            q[0] = x / b[0];
+            r[0] = x % b[0];
+            return;
+        }
+        for (unsigned k = 0; k < n; ++k) {
+            q[k] = 0;
+            r[k] = 0;
+        }
+        for (unsigned i = width; i > 0; --i) {
+            uint64_t carry = bit(a, i - 1);
+            for (unsigned k = 0; k < n; ++k) {
+                uint64_t next = r[k] >> 63;
+                r[k] = (r[k] << 1) | carry;
+                carry = next;
+            }
+            if (carry || compare(r, b, n) >= 0) {
+                sub(r, r, b, n);
+                q[(i - 1) / 64] |= 1ull << ((i - 1) % 64);
+            }
+        }
+    }
+
+    // Bits [bit, bit + 64) of a, reading fill past its end.
+    static uint64_t window(uint64_t const * a, unsigned n, long bit, uint64_t fill) {
+        if (bit <= -64)
+            return 0;
+        if (bit < 0)
+            return a[0] << (-bit);
+        unsigned w = bit / 64;
+        unsigned o = bit % 64;
+        uint64_t lo = w < n ? a[w] : fill;
+        if (!o)
+            return lo;
+        uint64_t hi = w + 1 < n ? a[w + 1] : fill;
+        return (lo >> o) | (hi << (64 - o));
+    }
+
+    // r (of width rw) = a (of width aw) shifted right by s, filled with the
+    // sign of a for arithmetic shifts.
+    static void shift_right(uint64_t * r, unsigned rw, uint64_t const * a, unsigned aw, unsigned long s, bool arith) {
+        unsigned rn = nwords(rw);
+        unsigned an = nwords(aw);
+        bool fill = arith && sign(a, aw);
+        for (unsigned k = 0; k < rn; ++k) {
+            unsigned long b = s + 64ul * k;
+            r[k] = b >= aw ? (fill ? ~0ull : 0) : window(a, an, b, 0);
+            if (fill && b + 64 > aw) {
+                unsigned valid = b < aw ? aw - b : 0;
+                r[k] |= valid >= 64 ? 0 : ~0ull << valid;
+            }
+        }
+        r[rn - 1] &= top_mask(rw);
+    }
+
+    // r |= a shifted left by s, truncated to the width of r.
+    static void or_shift_left(uint64_t * r, unsigned rw, uint64_t const * a, unsigned an, unsigned long s) {
+        unsigned rn = nwords(rw);
+        for (unsigned k = 0; k < rn; ++k) {
+            long b = 64l * k - (long)s;
+            if (b >= 64l * an)
+                break;
+            r[k] |= window(a, an, b, 0);
+        }
+        r[rn - 1] &= top_mask(rw);
+    }
+
+    static void zero(uint64_t * r, unsigned n) {
+        for (unsigned k = 0; k < n; ++k)
+            r[k] = 0;
+    }
+
+    // Shift amount of b, saturated to width.
+    static unsigned long amount(uint64_t const * b, unsigned width) {
+        unsigned n = nwords(width);
+        for (unsigned k = 1; k < n; ++k)
+            if (b[k])
+                return width;
+        return b[0] < width ? b[0] : width;
+    }
+
+    static unsigned long modulo(uint64_t const * b, unsigned width) {
+        unsigned n = nwords(width);
+        unsigned __int128 m = 0;
+        for (unsigned k = n; k > 0; --k)
+            m = ((m << 64) | b[k - 1]) % width;
+        return (unsigned long)m;
+    }
+
+    void rotate_left(uint64_t * r, uint64_t const * a, unsigned width, unsigned long s) {
+        unsigned n = nwords(width);
+        s %= width;
+        zero(r, n);
+        or_shift_left(r, width, a, n, s);
+        uint64_t * t = &scratch[0];
+        shift_right(t, width, a, width, width - s, false);
+        for (unsigned k = 0; k < n; ++k)
+            r[k] |= s ? t[k] : 0;
+    }
+
+    // Signed division and remainders, defined from their unsigned versions
+    // as in the SMT-LIB standard.
+    void signed_div(Instr const & in, uint64_t * r, uint64_t const * a, uint64_t const * b) {
+        unsigned w = in.width;
+        unsigned n = in.words;
+        bool sa = sign(a, w);
+        bool sb = sign(b, w);
+        uint64_t * x = &scratch[0];
+        uint64_t * y = &scratch[n];
+        uint64_t * q = &scratch[2 * n];
+        uint64_t * m = &scratch[3 * n];
+        if (sa)
+            neg(x, a, w);
+        else
+            copy(x, a, n);
+        if (sb)
+            neg(y, b, w);
+        else
+            copy(y, b, n);
+        udivrem(q, m, x, y, w);
+        switch (in.op) {
+        case OP_BSDIV:
+            if (sa != sb)
+                neg(r, q, w);
+            else
+                copy(r, q, n);
+            break;
+        case OP_BSREM:
+            if (sa)
+                neg(r, m, w);
+            else
+                copy(r, m, n);
+            break;
+        case OP_BSMOD:
+            if (is_zero(m, n) || (!sa && !sb)) {
+                copy(r, m, n);
+            } else if (sa && !sb) {
+                neg(m, m, w);
+                add(r, m, b, n);
+            } else if (!sa && sb) {
+                add(r, m, b, n);
+            } else {
+                neg(r, m, w);
+            }
+            r[n - 1] &= top_mask(w);
+            break;
+        }
+    }
+
+    // Value of an array at index i: follows the stores back to the base.
+    uint64_t const * select(unsigned handle, uint64_t const * i) {
+        while (true) {
+            Instr const & a = code[handle];
+            switch (a.op) {
+            case OP_STORE:
+                if (equal(val(a.first + 1), i, operand(a, 1).words))
+                    return val(a.first + 2);
+                handle = val(a.first)[0];
+                break;
+            case OP_CONST_ARRAY:
+                return val(a.first);
+            default:
+                return lookup(tables[a.p0], i);
+            }
+        }
+    }
+
+    static uint64_t const * lookup(Table const & t, uint64_t const * key) {
+        unsigned size = t.key_words + t.val_words;
+        for (uint64_t j = 0; j < t.size; ++j) {
+            uint64_t const * e = t.entries + j * size;
+            if (equal(e, key, t.key_words))
+                return e + t.key_words;
+        }
+        return t.def;
+    }
+
+    void step(Instr const & in) {
+        uint64_t * r = &values[in.dst];
+        unsigned n = in.words;
+        switch (in.op) {
+        case OP_VAR:
+        case OP_ARRAY_VAR:
+        case OP_NUM:
+            return;
+        case OP_ITE:
+            copy(r, val(in.first)[0] ? val(in.first + 1) : val(in.first + 2), n);
+            return;
+        case OP_EQ:
+        {
+            unsigned m = operand(in, 0).words;
+            r[0] = 1;
+            for (unsigned i = 1; i < in.num && r[0]; ++i)
+                r[0] = equal(val(in.first), val(in.first + i), m);
+            return;
+        }
+        case OP_DISTINCT:
+        {
+            unsigned m = operand(in, 0).words;
+            r[0] = 1;
+            for (unsigned i = 0; i < in.num && r[0]; ++i)
+                for (unsigned j = i + 1; j < in.num && r[0]; ++j)
+                    r[0] = !equal(val(in.first + i), val(in.first + j), m);
+            return;
+        }
+        case OP_AND:
+            r[0] = 1;
+            for (unsigned i = 0; i < in.num && r[0]; ++i)
+                r[0] = val(in.first + i)[0];
+            return;
+        case OP_OR:
+            r[0] = 0;
+            for (unsigned i = 0; i < in.num && !r[0]; ++i)
+                r[0] = val(in.first + i)[0];
+            return;
+        case OP_NOT:
+            r[0] = !val(in.first)[0];
+            return;
+        case OP_XOR:
+            r[0] = 0;
+            for (unsigned i = 0; i < in.num; ++i)
+                r[0] ^= val(in.first + i)[0];
+            return;
+        case OP_IMPLIES:
+            r[0] = !val(in.first)[0] || val(in.first + 1)[0];
+            return;
+        case OP_BNOT:
+        case OP_BNAND:
+        case OP_BNOR:
+        case OP_BXNOR:
+        case OP_BAND:
+        case OP_BOR:
+        case OP_BXOR:
+            copy(r, val(in.first), n);
+            for (unsigned i = 1; i < in.num; ++i) {
+                uint64_t const * b = val(in.first + i);
+                for (unsigned k = 0; k < n; ++k) {
+                    if (in.op == OP_BAND || in.op == OP_BNAND)
+                        r[k] &= b[k];
+                    else if (in.op == OP_BOR || in.op == OP_BNOR)
+                        r[k] |= b[k];
+                    else
+                        r[k] ^= b[k];
+                }
+            }
+            if (in.op == OP_BNOT || in.op == OP_BNAND || in.op == OP_BNOR || in.op == OP_BXNOR) {
+                for (unsigned k = 0; k < n; ++k)
+                    r[k] = ~r[k];
+            }
+            break;
+        case OP_BNEG:
+            neg(r, val(in.first), in.width);
+            return;
+        case OP_BADD:
+            copy(r, val(in.first), n);
+            for (unsigned i = 1; i < in.num; ++i)
+                add(r, r, val(in.first + i), n);
+            break;
+        case OP_BSUB:
+            copy(r, val(in.first), n);
+            for (unsigned i = 1; i < in.num; ++i)
+                sub(r, r, val(in.first + i), n);
+            break;
+        case OP_BMUL:
+            copy(r, val(in.first), n);
+            for (unsigned i = 1; i < in.num; ++i)
+                mul(r, r, val(in.first + i), n, &scratch[0]);
+            break;
+        case OP_BUDIV:
+            udivrem(r, &scratch[0], val(in.first), val(in.first + 1), in.width);
+            return;
+        case OP_BUREM:
+            udivrem(&scratch[0], r, val(in.first), val(in.first + 1), in.width);
+            return;
+        case OP_BSDIV:
+        case OP_BSREM:
+        case OP_BSMOD:
+            signed_div(in, r, val(in.first), val(in.first + 1));
+            return;
+        case OP_BSHL:
+            zero(r, n);
+            or_shift_left(r, in.width, val(in.first), n, amount(val(in.first + 1), in.width));
+            return;
+        case OP_BLSHR:
+        case OP_BASHR:
+            shift_right(r, in.width, val(in.first), in.width, amount(val(in.first + 1), in.width), in.op == OP_BASHR);
+            return;
+        case OP_ROTATE_LEFT:
+            rotate_left(r, val(in.first), in.width, in.p0);
+            return;
+        case OP_ROTATE_RIGHT:
+            rotate_left(r, val(in.first), in.width, in.width - in.p0);
+            return;
+        case OP_EXT_ROTATE_LEFT:
+            rotate_left(r, val(in.first), in.width, modulo(val(in.first + 1), in.width));
+            return;
+        case OP_EXT_ROTATE_RIGHT:
+            rotate_left(r, val(in.first), in.width, in.width - modulo(val(in.first + 1), in.width));
+            return;
+        case OP_ULEQ:
+        case OP_ULT:
+        case OP_UGEQ:
+        case OP_UGT:
+        {
+            int c = compare(val(in.first), val(in.first + 1), operand(in, 0).words);
+            r[0] = in.op == OP_ULEQ ? c <= 0 : in.op == OP_ULT ? c < 0 : in.op == OP_UGEQ ? c >= 0 : c > 0;
+            return;
+        }
+        case OP_SLEQ:
+        case OP_SLT:
+        case OP_SGEQ:
+        case OP_SGT:
+        {
+            int c = scompare(val(in.first), val(in.first + 1), operand(in, 0).width);
+            r[0] = in.op == OP_SLEQ ? c <= 0 : in.op == OP_SLT ? c < 0 : in.op == OP_SGEQ ? c >= 0 : c > 0;
+            return;
+        }
+        case OP_CONCAT:
+        {
+            zero(r, n);
+            unsigned long s = 0;
+            for (unsigned i = in.num; i > 0; --i) {
+                Instr const & a = operand(in, i - 1);
+                or_shift_left(r, in.width, val(in.first + i - 1), a.words, s);
+                s += a.width;
+            }
+            return;
+        }
+        case OP_EXTRACT:
+            shift_right(r, in.width, val(in.first), operand(in, 0).width, in.p1, false);
+            return;
+        case OP_ZERO_EXT:
+        case OP_SIGN_EXT:
+        {
+            Instr const & a = operand(in, 0);
+            zero(r, n);
+            copy(r, val(in.first), a.words);
+            if (in.op == OP_SIGN_EXT && sign(val(in.first), a.width)) {
+                for (unsigned i = a.width; i < in.width; ++i)
+                    r[i / 64] |= 1ull << (i % 64);
+            }
+            return;
+        }
+        case OP_REPEAT:
+        {
+            Instr const & a = operand(in, 0);
+            zero(r, n);
+            for (unsigned long s = 0; s < in.width; s += a.width)
+                or_shift_left(r, in.width, val(in.first), a.words, s);
+            return;
+        }
+        case OP_BCOMP:
+            r[0] = equal(val(in.first), val(in.first + 1), operand(in, 0).words);
+            return;
+        case OP_BREDOR:
+            r[0] = !is_zero(val(in.first), operand(in, 0).words);
+            return;
+        case OP_BREDAND:
+        {
+            Instr const & a = operand(in, 0);
+            uint64_t const * x = val(in.first);
+            r[0] = 1;
+            for (unsigned k = 0; k < a.words; ++k)
+                if (x[k] != (k + 1 == a.words ? top_mask(a.width) : ~0ull))
+                    r[0] = 0;
+            return;
+        }
+        case OP_SELECT:
+            copy(r, select(val(in.first)[0], val(in.first + 1)), n);
+            return;
+        case OP_STORE:
+        case OP_CONST_ARRAY:
+            r[0] = &in - &code[0];
+            return;
+        case OP_APPLY:
+        {
+            Table const & t = tables[in.p0];
+            uint64_t * key = &scratch[0];
+            for (unsigned i = 0; i < in.num; ++i) {
+                unsigned m = operand(in, i).words;
+                copy(key, val(in.first + i), m);
+                key += m;
+            }
+            copy(r, lookup(t, &scratch[0]), n);
+            return;
+        }
+        }
+        r[n - 1] &= top_mask(in.width);
+    }
+};
+
+// Number of 64-bit words of candidates checked together by BatchEvaluator.
+// The loops over them are simple enough for the compiler to vectorise, so
+// with -mavx2 a batch of 256 candidates is checked with 256-bit operations.
+#ifndef BATCH_WORDS
+#define BATCH_WORDS 4
+#endif
+
+// Bit-sliced evaluator for purely Boolean formulas, such as the bit-blasted
+// goal of --sat. Candidates are added to a batch, one bit lane each, and
+// eval() checks the whole batch at once with word-wide AND/OR/XOR.
+class BatchEvaluator {
+    enum {
+        OP_VAR,
+        OP_NUM,
+        OP_NOT,
+        OP_AND,
+        OP_OR,
+        OP_XOR,
+        OP_EQ,
+        OP_IMPLIES,
+        OP_ITE
+    };
+
+    struct Instr {
+        int op;
+        unsigned first;
+        unsigned num;
+    };
+
+    struct Slice {
+        uint64_t w[BATCH_WORDS];
+    };
+
+    std::vector<Instr> code;
+    std::vector<unsigned> args;
+    std::vector<Slice> values;
+    unsigned root = 0;
+    unsigned lanes = 0;
+    bool ready = false;
+
+public:
+    static const unsigned capacity = 64 * BATCH_WORDS;
+
+    std::string unsupported;
+
+    // Compiles formula, whose free symbols must be the Boolean constants
+    // variables.
+    bool compile(z3::expr const & formula, std::vector<z3::func_decl> const & variables) {
+        Z3_context ctx = formula.ctx();
+        std::unordered_map<Z3_ast, unsigned> compiled;
+        for (z3::func_decl const & v : variables) {
+            if (v.arity() > 0 || !v.range().is_bool()) {
+                unsupported = "variable " + v.name().str();
+                return false;
+            }
+            compiled[v()] = emit(OP_VAR, 0, 0);
+        }
+        std::vector<std::pair<Z3_ast, bool>> todo;
+        todo.emplace_back(formula, false);
+        while (!todo.empty()) {
+            Z3_ast ast = todo.back().first;
+            bool expanded = todo.back().second;
+            if (compiled.find(ast) != compiled.end()) {
+                todo.pop_back();
+                continue;
+            }
+            if (Z3_get_ast_kind(ctx, ast) != Z3_APP_AST) {
+                unsupported = "quantifier or variable";
+                return false;
+            }
+            Z3_app app = Z3_to_app(ctx, ast);
+            unsigned n = Z3_get_app_num_args(ctx, app);
+            if (!expanded) {
+                todo.back().second = true;
+                for (unsigned i = n; i > 0; --i) {
+                    Z3_ast arg = Z3_get_app_arg(ctx, app, i - 1);
+                    if (compiled.find(arg) == compiled.end())
+                        todo.emplace_back(arg, false);
+                }
+                continue;
+            }
+            todo.pop_back();
+            z3::expr e(formula.ctx(), ast);
+            if (!e.is_bool()) {
+                unsupported = "non-Boolean term";
+                return false;
+            }
+            int op;
+            switch (e.decl().decl_kind()) {
+            case Z3_OP_TRUE:
+            case Z3_OP_FALSE:
+            {
+                unsigned i = emit(OP_NUM, 0, 0);
+                for (unsigned k = 0; k < BATCH_WORDS; ++k)
+                    values[i].w[k] = e.decl().decl_kind() == Z3_OP_TRUE ? ~0ull : 0;
+                compiled[ast] = i;
+                continue;
+            }
+            case Z3_OP_NOT: op = OP_NOT; break;
+            case Z3_OP_AND: op = OP_AND; break;
+            case Z3_OP_OR: op = OP_OR; break;
+            case Z3_OP_XOR: op = OP_XOR; break;
+            case Z3_OP_EQ:
+            case Z3_OP_IFF: op = OP_EQ; break;
+            case Z3_OP_IMPLIES: op = OP_IMPLIES; break;
+            case Z3_OP_ITE: op = OP_ITE; break;
+            case Z3_OP_DISTINCT:
+                if (n != 2) {
+                    unsupported = "operator distinct";
+                    return false;
+                }
+                op = OP_XOR;
+                break;
+            default:
+                unsupported = "operator " + e.decl().name().str();
+                return false;
+            }
+            unsigned first = args.size();
+            for (unsigned i = 0; i < n; ++i)
+                args.push_back(compiled[e.arg(i)]);
+            compiled[ast] = emit(op, first, n);
+        }
+        root = compiled[formula];
+        ready = true;
+        clear();
+        return true;
+    }
+
+    bool ok() const {
+        return ready;
+    }
+
+    unsigned size() const {
+        return lanes;
+    }
+
+    bool full() const {
+        return lanes == capacity;
+    }
+
+    void clear() {
+        lanes = 0;
+        for (unsigned i = 0; i < code.size(); ++i) {
+            if (code[i].op != OP_VAR)
+                continue;
+            for (unsigned k = 0; k < BATCH_WORDS; ++k)
+                values[i].w[k] = 0;
+        }
+    }
+
+    // Adds a sample of the variables as the next lane. Being all Boolean
+    // constants, variable i is bit i of the sample.
+    void add(Sample const & sample) {
+        uint64_t bit = 1ull << (lanes % 64);
+        unsigned word = lanes / 64;
+        for (unsigned i = 0; i < code.size() && code[i].op == OP_VAR; ++i) {
+            if ((sample[i / 64] >> (i % 64)) & 1)
+                values[i].w[word] |= bit;
+        }
+        ++lanes;
+    }
+
+    // Checks the batch; bit i of the result tells whether lane i is valid.
+    void eval(std::vector<uint64_t> & mask) {
+        for (unsigned i = 0; i < code.size(); ++i) {
+            Instr const & in = code[i];
+            uint64_t * r = values[i].w;
+            switch (in.op) {
+            case OP_VAR:
+            case OP_NUM:
+                break;
+            case OP_NOT:
+                for (unsigned k = 0; k < BATCH_WORDS; ++k)
+                    r[k] = ~arg(in, 0)[k];
+                break;
+            case OP_AND:
+                for (unsigned k = 0; k < BATCH_WORDS; ++k)
+                    r[k] = ~0ull;
+                for (unsigned j = 0; j < in.num; ++j) {
+                    uint64_t const * a = arg(in, j);
+                    for (unsigned k = 0; k < BATCH_WORDS; ++k)
+                        r[k] &= a[k];
+                }
+                break;
+            case OP_OR:
+            case OP_XOR:
+                for (unsigned k = 0; k < BATCH_WORDS; ++k)
+                    r[k] = 0;
+                for (unsigned j = 0; j < in.num; ++j) {
+                    uint64_t const * a = arg(in, j);
+                    for (unsigned k = 0; k < BATCH_WORDS; ++k)
+                        r[k] = in.op == OP_OR ? r[k] | a[k] : r[k] ^ a[k];
+                }
+                break;
+            case OP_EQ:
+                for (unsigned k = 0; k < BATCH_WORDS; ++k)
+                    r[k] = ~0ull;
+                for (unsigned j = 1; j < in.num; ++j) {
+                    uint64_t const * a = arg(in, 0);
+                    uint64_t const * b = arg(in, j);
+                    for (unsigned k = 0; k < BATCH_WORDS; ++k)
+                        r[k] &= ~(a[k] ^ b[k]);
+                }
+                break;
+            case OP_IMPLIES:
+                for (unsigned k = 0; k < BATCH_WORDS; ++k)
+                    r[k] = ~arg(in, 0)[k] | arg(in, 1)[k];
+                break;
+            case OP_ITE:
+            {
+                uint64_t const * c = arg(in, 0);
+                uint64_t const * a = arg(in, 1);
+                uint64_t const * b = arg(in, 2);
+                for (unsigned k = 0; k < BATCH_WORDS; ++k)
+                    r[k] = (c[k] & a[k]) | (~c[k] & b[k]);
+                break;
+            }
+            }
+        }
+        mask.assign(values[root].w, values[root].w + BATCH_WORDS);
+    }
+
+private:
+    unsigned emit(int op, unsigned first, unsigned num) {
+        Instr i;
+        i.op = op;
+        i.first = first;
+        i.num = num;
+        code.push_back(i);
+        values.resize(code.size());
+        return code.size() - 1;
+    }
+
+    uint64_t const * arg(Instr const & in, unsigned j) {
+        return values[args[in.first + j]].w;
+    }
+};
+
+#endif
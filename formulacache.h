@@ -0,0 +1,162 @@
+#ifndef FORMULACACHE_H
+#define FORMULACACHE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <z3++.h>
+#include <string>
+#include <vector>
+#include "sample.h"
+
+// What startup learns about a formula besides parsing it, saved under the
+// hash of the formula file, and apart for --sat, so that later runs skip
+// the walks over the formula and the first check:
+//
+//   "SMTFCv2", then the uint64s hash of the formula file, number of
+//   counts, the counts, number of variables; for every variable its kind
+//   (0 constant, 1 array, 2 function), whether its value is a Bool, its
+//   width, its arity, a (Bool, width) pair per argument, and its name as a
+//   length and bytes; then the number of words of the first solution,
+//   as a sample of the variables, and its words; then the number of words
+//   of the cone of every variable, 0 if the cones were not found, and the
+//   words of each variable's cone in turn.
+#define FORMULA_CACHE_MAGIC "SMTFCv2"
+
+struct FormulaCache {
+    uint64_t hash = 0;
+    // Nodes, internal nodes, arrays, bit-vectors, Bools, bits and
+    // uninterpreted functions.
+    std::vector<uint64_t> counts;
+    std::vector<std::string> names;
+    std::vector<SampleLayout::Field> fields;
+    // The first solution, if the first check was on the formula itself.
+    Sample model;
+    // The conjuncts every variable occurs in, if they were found.
+    std::vector<std::vector<uint64_t>> cones;
+
+    // Rebuilds the declarations of the variables in c.
+    std::vector<z3::func_decl> decls(z3::context & c) const {
+        std::vector<z3::func_decl> result;
+        for (unsigned i = 0; i < fields.size(); ++i) {
+            SampleLayout::Field const & f = fields[i];
+            z3::sort range = sort(c, f.is_bool, f.width);
+            z3::sort_vector domain(c);
+            if (f.is_array) {
+                range = c.array_sort(sort(c, f.arg_bool[0], f.arg_width[0]), range);
+            } else {
+                for (unsigned k = 0; k < f.arg_width.size(); ++k)
+                    domain.push_back(sort(c, f.arg_bool[k], f.arg_width[k]));
+            }
+            result.push_back(c.function(names[i].c_str(), domain, range));
+        }
+        return result;
+    }
+
+    bool save(std::string const & name) const {
+        std::string tmp = name + ".tmp";
+        FILE * f = fopen(tmp.c_str(), "wb");
+        if (!f)
+            return false;
+        fwrite(FORMULA_CACHE_MAGIC, 1, 8, f);
+        write64(f, hash);
+        write64(f, counts.size());
+        fwrite(counts.data(), sizeof(uint64_t), counts.size(), f);
+        write64(f, fields.size());
+        for (unsigned i = 0; i < fields.size(); ++i) {
+            SampleLayout::Field const & v = fields[i];
+            write64(f, v.is_array ? 1 : v.is_table ? 2 : 0);
+            write64(f, v.is_bool);
+            write64(f, v.width);
+            write64(f, v.arg_width.size());
+            for (unsigned k = 0; k < v.arg_width.size(); ++k) {
+                write64(f, v.arg_bool[k]);
+                write64(f, v.arg_width[k]);
+            }
+            write64(f, names[i].size());
+            fwrite(names[i].data(), 1, names[i].size(), f);
+        }
+        write64(f, model.size());
+        fwrite(model.data(), sizeof(uint64_t), model.size(), f);
+        write64(f, cones.empty() ? 0 : cones[0].size());
+        for (unsigned i = 0; i < cones.size(); ++i)
+            fwrite(cones[i].data(), sizeof(uint64_t), cones[i].size(), f);
+        bool ok = !ferror(f);
+        ok = fclose(f) == 0 && ok;
+        return ok && rename(tmp.c_str(), name.c_str()) == 0;
+    }
+
+    // Reads the cache saved in name, if it is for a formula file with the
+    // given hash.
+    bool load(std::string const & name, uint64_t file_hash) {
+        FILE * f = fopen(name.c_str(), "rb");
+        if (!f)
+            return false;
+        bool ok = read(f) && hash == file_hash;
+        fclose(f);
+        return ok;
+    }
+
+private:
+    static z3::sort sort(z3::context & c, bool is_bool, unsigned width) {
+        return is_bool ? c.bool_sort() : c.bv_sort(width);
+    }
+
+    static void write64(FILE * f, uint64_t v) {
+        fwrite(&v, sizeof(uint64_t), 1, f);
+    }
+
+    static bool read64(FILE * f, uint64_t & v) {
+        return fread(&v, sizeof(uint64_t), 1, f) == 1;
+    }
+
+    bool read(FILE * f) {
+        char magic[8];
+        uint64_t n;
+        if (fread(magic, 1, 8, f) != 8 || memcmp(magic, FORMULA_CACHE_MAGIC, 8))
+            return false;
+        if (!read64(f, hash) || !read64(f, n))
+            return false;
+        counts.resize(n);
+        if (fread(counts.data(), sizeof(uint64_t), n, f) != n || !read64(f, n))
+            return false;
+        for (uint64_t i = 0; i < n; ++i) {
+            SampleLayout::Field v;
+            uint64_t kind, is_bool, width, arity, len;
+            if (!read64(f, kind) || !read64(f, is_bool) || !read64(f, width) || !read64(f, arity))
+                return false;
+            v.is_array = kind == 1;
+            v.is_table = kind != 0;
+            v.is_bool = is_bool;
+            v.width = width;
+            for (uint64_t k = 0; k < arity; ++k) {
+                uint64_t b, w;
+                if (!read64(f, b) || !read64(f, w))
+                    return false;
+                v.arg_bool.push_back(b);
+                v.arg_width.push_back(w);
+            }
+            if (!read64(f, len))
+                return false;
+            std::string s(len, '\0');
+            if (fread(&s[0], 1, len, f) != len)
+                return false;
+            fields.push_back(v);
+            names.push_back(s);
+        }
+        if (!read64(f, n))
+            return false;
+        model.resize(n);
+        if (fread(model.data(), sizeof(uint64_t), n, f) != n || !read64(f, n))
+            return false;
+        if (n > 0)
+            cones.assign(fields.size(), std::vector<uint64_t>(n));
+        for (unsigned i = 0; i < cones.size(); ++i) {
+            if (fread(cones[i].data(), sizeof(uint64_t), n, f) != n)
+                return false;
+        }
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,120 @@
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include "smtsampler.h"
+
+int main(int argc, char * argv[]) {
+    Options o;
+    if (argc < 2) {
+        std::cout << "Argument required: input file\n";
+        return 0;
+    }
+    bool arg_samples = false;
+    bool arg_time = false;
+    bool arg_jobs = false;
+    bool arg_flip_jobs = false;
+    bool arg_check_jobs = false;
+    bool arg_engine = false;
+    bool arg_timeout = false;
+    bool arg_stats_json = false;
+    bool arg_seed = false;
+    bool arg_checkpoint = false;
+    bool arg_cache = false;
+    bool arg_combine_budget = false;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-n") == 0)
+            arg_samples = true;
+        else if (strcmp(argv[i], "-t") == 0)
+            arg_time = true;
+        else if (strcmp(argv[i], "-j") == 0)
+            arg_jobs = true;
+        else if (strcmp(argv[i], "--flip-jobs") == 0)
+            arg_flip_jobs = true;
+        else if (strcmp(argv[i], "--check-jobs") == 0)
+            arg_check_jobs = true;
+        else if (strcmp(argv[i], "--engine") == 0)
+            arg_engine = true;
+        else if (strcmp(argv[i], "--timeout") == 0)
+            arg_timeout = true;
+        else if (strcmp(argv[i], "--stats-json") == 0)
+            arg_stats_json = true;
+        else if (strcmp(argv[i], "--seed") == 0)
+            arg_seed = true;
+        else if (strcmp(argv[i], "--checkpoint") == 0)
+            arg_checkpoint = true;
+        else if (strcmp(argv[i], "--resume") == 0)
+            o.resume = true;
+        else if (strcmp(argv[i], "--backbone") == 0)
+            o.backbone = true;
+        else if (strcmp(argv[i], "--components") == 0)
+            o.components = true;
+        else if (strcmp(argv[i], "--cache") == 0)
+            arg_cache = true;
+        else if (strcmp(argv[i], "--combine-budget") == 0)
+            arg_combine_budget = true;
+        else if (strcmp(argv[i], "--exact-dedupe") == 0)
+            o.exact_dedupe = true;
+        else if (strcmp(argv[i], "--binary") == 0)
+            o.binary = true;
+        else if (strcmp(argv[i], "--assumptions") == 0)
+            o.assumptions = true;
+        else if (strcmp(argv[i], "--smtbit") == 0)
+            o.strategy = STRAT_SMTBIT;
+        else if (strcmp(argv[i], "--smtbv") == 0)
+            o.strategy = STRAT_SMTBV;
+        else if (strcmp(argv[i], "--sat") == 0)
+            o.strategy = STRAT_SAT;
+        else if (arg_samples) {
+            arg_samples = false;
+            o.max_samples = atoi(argv[i]);
+        } else if (arg_time) {
+            arg_time = false;
+            o.max_time = atof(argv[i]);
+        } else if (arg_jobs) {
+            arg_jobs = false;
+            o.jobs = atoi(argv[i]);
+        } else if (arg_flip_jobs) {
+            arg_flip_jobs = false;
+            o.flip_jobs = atoi(argv[i]);
+        } else if (arg_check_jobs) {
+            arg_check_jobs = false;
+            o.check_jobs = atoi(argv[i]);
+        } else if (arg_engine) {
+            arg_engine = false;
+            if (strcmp(argv[i], "opt") == 0) {
+                o.engine = ENGINE_OPT;
+            } else if (strcmp(argv[i], "relax") == 0) {
+                o.engine = ENGINE_RELAX;
+            } else {
+                std::cout << "Unknown engine " << argv[i] << ", expected opt or relax\n";
+                return 1;
+            }
+        } else if (arg_timeout) {
+            arg_timeout = false;
+            o.timeout = atoi(argv[i]);
+            o.adaptive_timeout = false;
+        } else if (arg_stats_json) {
+            arg_stats_json = false;
+            o.stats_json = argv[i];
+        } else if (arg_seed) {
+            arg_seed = false;
+            o.seed = strtoull(argv[i], NULL, 10);
+            o.has_seed = true;
+        } else if (arg_checkpoint) {
+            arg_checkpoint = false;
+            o.checkpoint = atof(argv[i]);
+        } else if (arg_cache) {
+            arg_cache = false;
+            o.cache_dir = argv[i];
+        } else if (arg_combine_budget) {
+            arg_combine_budget = false;
+            o.combine_budget = atol(argv[i]);
+        }
+    }
+    Sampler s(argv[argc-1], o);
+    if (!s.write_samples()) {
+        std::cout << s.error() << '\n';
+        return s.status();
+    }
+    return 0;
+}
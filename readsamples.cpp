@@ -0,0 +1,113 @@
+#include <string.h>
+#include <stdlib.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "samplefile.h"
+
+// Prints the samples of a binary samples file, as the lines of a text
+// samples file or as SMT-LIB models.
+
+std::string sort_name(bool is_bool, unsigned width) {
+    if (is_bool)
+        return "Bool";
+    return "(_ BitVec " + std::to_string(width) + ")";
+}
+
+std::string smt_value(uint64_t const * v, bool is_bool, unsigned width) {
+    if (is_bool)
+        return v[0] ? "true" : "false";
+    std::string s;
+    if (width % 4 == 0) {
+        SampleLayout::render_value(s, v, false, width);
+        s.pop_back();
+        return "#x" + s;
+    }
+    s = "#b";
+    for (unsigned i = width; i > 0; --i)
+        s += (v[(i - 1) / 64] >> ((i - 1) % 64)) & 1 ? '1' : '0';
+    return s;
+}
+
+void print_model(SampleFileReader const & reader, Sample const & s) {
+    SampleLayout const & layout = reader.layout;
+    std::cout << "(model\n";
+    std::vector<uint64_t> v;
+    size_t pos = layout.words;
+    for (unsigned i = 0; i < layout.fields.size(); ++i) {
+        SampleLayout::Field const & f = layout.fields[i];
+        std::string const & name = reader.names[i];
+        std::string range = sort_name(f.is_bool, f.width);
+        if (!f.is_table) {
+            v.resize(SampleLayout::nwords(f.width));
+            layout.get(s, f, v.data());
+            std::cout << "  (define-fun " << name << " () " << range << ' ' << smt_value(v.data(), f.is_bool, f.width) << ")\n";
+            continue;
+        }
+        uint64_t num = s[pos];
+        std::string body = smt_value(&s[pos + 1], f.is_bool, f.width);
+        size_t e = pos + 1 + f.val_words;
+        if (f.is_array) {
+            std::string domain = sort_name(f.arg_bool[0], f.arg_width[0]);
+            std::string sort = "(Array " + domain + ' ' + range + ')';
+            body = "((as const " + sort + ") " + body + ')';
+            for (uint64_t j = 0; j < num; ++j) {
+                std::string key = smt_value(&s[e], f.arg_bool[0], f.arg_width[0]);
+                e += f.key_words;
+                body = "(store " + body + ' ' + key + ' ' + smt_value(&s[e], f.is_bool, f.width) + ')';
+                e += f.val_words;
+            }
+            std::cout << "  (define-fun " << name << " () " << sort << ' ' << body << ")\n";
+        } else {
+            std::vector<std::string> entries;
+            for (uint64_t j = 0; j < num; ++j) {
+                std::string cond = "(and";
+                for (unsigned k = 0; k < f.arg_width.size(); ++k) {
+                    cond += " (= x!" + std::to_string(k) + ' ' + smt_value(&s[e], f.arg_bool[k], f.arg_width[k]) + ')';
+                    e += SampleLayout::nwords(f.arg_width[k]);
+                }
+                cond += ')';
+                body = "(ite " + cond + ' ' + smt_value(&s[e], f.is_bool, f.width) + ' ' + body + ')';
+                e += f.val_words;
+            }
+            std::cout << "  (define-fun " << name << " (";
+            for (unsigned k = 0; k < f.arg_width.size(); ++k)
+                std::cout << (k ? " " : "") << "(x!" << k << ' ' << sort_name(f.arg_bool[k], f.arg_width[k]) << ')';
+            std::cout << ") " << range << ' ' << body << ")\n";
+        }
+        pos += SampleLayout::table_size(f, num);
+    }
+    std::cout << ")\n";
+}
+
+int main(int argc, char * argv[]) {
+    bool smt2 = false;
+    std::vector<char const *> args;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--smt2") == 0)
+            smt2 = true;
+        else
+            args.push_back(argv[i]);
+    }
+    if (args.empty()) {
+        std::cout << "Usage: readsamples [--smt2] formula.smt2.samples.bin [first [count]]\n";
+        return 0;
+    }
+    SampleFileReader reader;
+    if (!reader.open(args[0])) {
+        std::cout << "Could not read samples file " << args[0] << ": " << reader.error << '\n';
+        return 1;
+    }
+    uint64_t first = args.size() > 1 ? strtoull(args[1], NULL, 10) : 0;
+    uint64_t count = args.size() > 2 ? strtoull(args[2], NULL, 10) : reader.size();
+    for (uint64_t i = first; i < reader.size() && i - first < count; ++i) {
+        Sample s = reader.sample(i);
+        if (smt2) {
+            std::cout << "; sample " << i << ", " << reader.mutations(i) << " mutations\n";
+            print_model(reader, s);
+        } else {
+            std::cout << reader.mutations(i) << ": " << reader.layout.render(s) << '\n';
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,488 @@
+#ifndef SAMPLE_H
+#define SAMPLE_H
+
+#include <z3++.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+// A sample is a packed record of the values of a list of variables. The
+// constants come first, packed bit by bit at fixed offsets. Each array or
+// uninterpreted function then follows as a table: the number of entries,
+// the default value, and the entries sorted by their arguments. Inside a
+// table every argument and value starts on a word boundary.
+typedef std::vector<uint64_t> Sample;
+
+// 128-bit hash of a sample. Two different samples have the same
+// fingerprint with probability about 2^-128.
+struct Fingerprint {
+    uint64_t lo;
+    uint64_t hi;
+};
+
+inline uint64_t fmix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+inline Fingerprint fingerprint(Sample const & s) {
+    uint64_t lo = 0x9e3779b97f4a7c15ull ^ s.size();
+    uint64_t hi = 0x6a09e667f3bcc909ull + s.size();
+    for (uint64_t w : s) {
+        lo = (lo ^ fmix64(w)) * 0x87c37b91114253d5ull;
+        lo = (lo << 31) | (lo >> 33);
+        hi = (hi + w) * 0x4cf5ad432745937full;
+        hi ^= hi >> 29;
+    }
+    Fingerprint f;
+    f.lo = fmix64(lo ^ hi);
+    f.hi = fmix64(hi + f.lo);
+    if (!f.lo && !f.hi)
+        f.lo = 1;
+    return f;
+}
+
+// Set of samples kept as fingerprints in a flat open-addressing table, so
+// that a sample costs about 16 bytes whatever its size. In exact mode the
+// samples are also kept, and compared whenever fingerprints match.
+class SampleSet {
+    std::vector<Fingerprint> slots;
+    std::vector<uint32_t> index;
+    std::vector<Sample> kept;
+    size_t count = 0;
+    size_t words = 0;
+    bool exact;
+
+public:
+    explicit SampleSet(bool exact = false) : slots(1024), exact(exact) {
+        if (exact)
+            index.resize(slots.size());
+    }
+
+    // Adds s, returning false if it was already in the set.
+    bool insert(Sample const & s) {
+        if (!place(fingerprint(s), &s))
+            return false;
+        words += s.size();
+        return true;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    // Bytes used by the set.
+    size_t memory() const {
+        size_t bytes = slots.size() * sizeof(Fingerprint) + index.size() * sizeof(uint32_t);
+        if (exact)
+            bytes += kept.capacity() * sizeof(Sample) + words * sizeof(uint64_t);
+        return bytes;
+    }
+
+    // Estimated bytes of a node-based hash set of the same samples: a node
+    // with the vector and the cached hash, its bucket, and the heap block
+    // of the words, with allocator headers.
+    size_t node_memory() const {
+        return count * (48 + 8 + 16) + words * sizeof(uint64_t);
+    }
+
+    // Writes the set to f, to be read back by load(): the number of samples
+    // and of their words, then the samples themselves in exact mode, or
+    // their fingerprints.
+    void save(FILE * f) const {
+        uint64_t h[3] = { count, words, exact };
+        fwrite(h, sizeof(uint64_t), 3, f);
+        if (exact) {
+            for (Sample const & s : kept) {
+                uint64_t n = s.size();
+                fwrite(&n, sizeof(uint64_t), 1, f);
+                fwrite(s.data(), sizeof(uint64_t), n, f);
+            }
+            return;
+        }
+        for (Fingerprint const & slot : slots) {
+            if (slot.lo || slot.hi) {
+                uint64_t fp[2] = { slot.lo, slot.hi };
+                fwrite(fp, sizeof(uint64_t), 2, f);
+            }
+        }
+    }
+
+    // Adds the samples saved in f. A set saved without its samples can
+    // only be read into a set that does not keep them either.
+    bool load(FILE * f) {
+        uint64_t h[3];
+        if (fread(h, sizeof(uint64_t), 3, f) != 3 || (exact && !h[2]))
+            return false;
+        for (uint64_t j = 0; j < h[0]; ++j) {
+            if (h[2]) {
+                uint64_t n;
+                if (fread(&n, sizeof(uint64_t), 1, f) != 1)
+                    return false;
+                Sample s(n);
+                if (fread(s.data(), sizeof(uint64_t), n, f) != n)
+                    return false;
+                insert(s);
+            } else {
+                uint64_t fp[2];
+                if (fread(fp, sizeof(uint64_t), 2, f) != 2)
+                    return false;
+                Fingerprint p = { fp[0], fp[1] };
+                place(p, NULL);
+            }
+        }
+        if (!h[2])
+            words += h[1];
+        return true;
+    }
+
+private:
+    // Adds a sample with fingerprint f, and s itself in exact mode.
+    bool place(Fingerprint f, Sample const * s) {
+        if (4 * (count + 1) > 3 * slots.size())
+            grow();
+        size_t mask = slots.size() - 1;
+        for (size_t i = f.lo & mask; ; i = (i + 1) & mask) {
+            Fingerprint & slot = slots[i];
+            if (!slot.lo && !slot.hi) {
+                slot = f;
+                if (exact) {
+                    index[i] = kept.size();
+                    kept.push_back(*s);
+                }
+                ++count;
+                return true;
+            }
+            if (slot.lo == f.lo && slot.hi == f.hi && (!exact || kept[index[i]] == *s))
+                return false;
+        }
+    }
+
+    void grow() {
+        std::vector<Fingerprint> old(2 * slots.size());
+        std::vector<uint32_t> old_index(exact ? old.size() : 0);
+        old.swap(slots);
+        old_index.swap(index);
+        size_t mask = slots.size() - 1;
+        for (size_t j = 0; j < old.size(); ++j) {
+            if (!old[j].lo && !old[j].hi)
+                continue;
+            size_t i = old[j].lo & mask;
+            while (slots[i].lo || slots[i].hi)
+                i = (i + 1) & mask;
+            slots[i] = old[j];
+            if (exact)
+                index[i] = old_index[j];
+        }
+    }
+};
+
+// Where the value of every variable is in a sample, computed once from the
+// list of variables (ind or variables) the samples are made of.
+class SampleLayout {
+public:
+    struct Field {
+        bool is_table;
+        bool is_array;
+        bool is_bool;
+        unsigned width;
+        unsigned offset;
+        std::vector<bool> arg_bool;
+        std::vector<unsigned> arg_width;
+        unsigned key_words;
+        unsigned val_words;
+    };
+
+    std::vector<Field> fields;
+    unsigned words = 0;
+
+    static unsigned nwords(unsigned width) {
+        return (width + 63) / 64;
+    }
+
+    static uint64_t top_mask(unsigned width) {
+        unsigned r = width % 64;
+        return r ? (1ull << r) - 1 : ~0ull;
+    }
+
+    void init(std::vector<z3::func_decl> const & decls) {
+        fields.clear();
+        unsigned bits = 0;
+        for (z3::func_decl const & v : decls) {
+            Field f;
+            f.is_array = v.range().is_array();
+            f.is_table = f.is_array || v.arity() > 0;
+            f.offset = 0;
+            f.key_words = 0;
+            if (f.is_array) {
+                add_arg(f, v.range().array_domain());
+                set_value(f, v.range().array_range());
+            } else if (f.is_table) {
+                for (unsigned i = 0; i < v.arity(); ++i)
+                    add_arg(f, v.domain(i));
+                set_value(f, v.range());
+            } else {
+                set_value(f, v.range());
+                f.offset = bits;
+                bits += f.width;
+            }
+            fields.push_back(f);
+        }
+        words = nwords(bits);
+    }
+
+    // Value of the bit-vector numeral e of the given width, in
+    // nwords(width) words.
+    static void numeral(z3::expr const & e, uint64_t * r, unsigned width) {
+        unsigned n = nwords(width);
+        for (unsigned k = 0; k < n; ++k)
+            r[k] = 0;
+        uint64_t v;
+        if (Z3_get_numeral_uint64(e.ctx(), e, &v)) {
+            r[0] = v;
+            return;
+        }
+        std::string dec = Z3_get_numeral_string(e.ctx(), e);
+        for (char ch : dec) {
+            unsigned __int128 carry = ch - '0';
+            for (unsigned k = 0; k < n; ++k) {
+                unsigned __int128 t = (unsigned __int128)r[k] * 10 + carry;
+                r[k] = (uint64_t)t;
+                carry = t >> 64;
+            }
+        }
+        r[n - 1] &= top_mask(width);
+    }
+
+    // Reads the constant f of s into r, which has nwords(f.width) words.
+    void get(Sample const & s, Field const & f, uint64_t * r) const {
+        unsigned n = nwords(f.width);
+        unsigned w = f.offset / 64;
+        unsigned o = f.offset % 64;
+        for (unsigned k = 0; k < n; ++k) {
+            uint64_t lo = s[w + k] >> o;
+            uint64_t hi = o && w + k + 1 < words ? s[w + k + 1] << (64 - o) : 0;
+            r[k] = lo | hi;
+        }
+        r[n - 1] &= top_mask(f.width);
+    }
+
+    void set(Sample & s, Field const & f, uint64_t const * v) const {
+        for (unsigned i = 0; i < f.width; ++i) {
+            unsigned b = f.offset + i;
+            uint64_t bit = 1ull << (b % 64);
+            if ((v[i / 64] >> (i % 64)) & 1)
+                s[b / 64] |= bit;
+            else
+                s[b / 64] &= ~bit;
+        }
+    }
+
+    // Position in s of the table of fields[index].
+    size_t table(Sample const & s, unsigned index) const {
+        size_t pos = words;
+        for (unsigned i = 0; i < index; ++i) {
+            Field const & f = fields[i];
+            if (f.is_table)
+                pos += table_size(f, s[pos]);
+        }
+        return pos;
+    }
+
+    static size_t table_size(Field const & f, uint64_t entries) {
+        return 1 + f.val_words + entries * (f.key_words + f.val_words);
+    }
+
+    // Sorts the entries of a table just written at pos.
+    static void sort_table(Sample & s, Field const & f, size_t pos) {
+        size_t n = s[pos];
+        size_t size = f.key_words + f.val_words;
+        size_t start = pos + 1 + f.val_words;
+        std::vector<size_t> order(n);
+        for (size_t j = 0; j < n; ++j)
+            order[j] = start + j * size;
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return std::lexicographical_compare(s.begin() + a, s.begin() + a + f.key_words,
+                                                s.begin() + b, s.begin() + b + f.key_words);
+        });
+        std::vector<uint64_t> sorted;
+        for (size_t e : order)
+            sorted.insert(sorted.end(), s.begin() + e, s.begin() + e + size);
+        std::copy(sorted.begin(), sorted.end(), s.begin() + start);
+    }
+
+    // Indices of the fields whose values differ between a and b.
+    std::vector<unsigned> changed(Sample const & a, Sample const & b) const {
+        std::vector<unsigned> result;
+        size_t pa = words;
+        size_t pb = words;
+        std::vector<uint64_t> va, vb;
+        for (unsigned i = 0; i < fields.size(); ++i) {
+            Field const & f = fields[i];
+            if (!f.is_table) {
+                va.resize(nwords(f.width));
+                vb.resize(nwords(f.width));
+                get(a, f, va.data());
+                get(b, f, vb.data());
+                if (va != vb)
+                    result.push_back(i);
+                continue;
+            }
+            size_t sa = table_size(f, a[pa]);
+            size_t sb = table_size(f, b[pb]);
+            if (sa != sb || !std::equal(a.begin() + pa, a.begin() + pa + sa, b.begin() + pb))
+                result.push_back(i);
+            pa += sa;
+            pb += sb;
+        }
+        return result;
+    }
+
+    // Every bit of the result takes the value of b or c where it differs
+    // from a, as in a ^ ((a ^ b) | (a ^ c)).
+    Sample combine(Sample const & a, Sample const & b, Sample const & c) const {
+        Sample r(words);
+        for (unsigned k = 0; k < words; ++k)
+            r[k] = a[k] ^ ((a[k] ^ b[k]) | (a[k] ^ c[k]));
+        size_t pa = words;
+        size_t pb = words;
+        size_t pc = words;
+        for (Field const & f : fields) {
+            if (!f.is_table)
+                continue;
+            combine_table(f, a, pa, b, pb, c, pc, r);
+            pa += table_size(f, a[pa]);
+            pb += table_size(f, b[pb]);
+            pc += table_size(f, c[pc]);
+        }
+        return r;
+    }
+
+    // Text form used in the samples file: hexadecimal values separated by
+    // '\0', with tables as [n def arg val ...] for arrays and (n def args
+    // val ...) for functions.
+    std::string render(Sample const & s) const {
+        std::string out;
+        std::vector<uint64_t> v;
+        size_t pos = words;
+        for (Field const & f : fields) {
+            if (!f.is_table) {
+                v.resize(nwords(f.width));
+                get(s, f, v.data());
+                render_value(out, v.data(), f.is_bool, f.width);
+                continue;
+            }
+            uint64_t n = s[pos];
+            out += f.is_array ? "[" : "(";
+            out += std::to_string(n);
+            out += '\0';
+            render_value(out, &s[pos + 1], f.is_bool, f.width);
+            size_t e = pos + 1 + f.val_words;
+            for (uint64_t j = 0; j < n; ++j) {
+                for (unsigned k = 0; k < f.arg_width.size(); ++k) {
+                    render_value(out, &s[e], f.arg_bool[k], f.arg_width[k]);
+                    e += nwords(f.arg_width[k]);
+                }
+                render_value(out, &s[e], f.is_bool, f.width);
+                e += f.val_words;
+            }
+            out += f.is_array ? "]" : ")";
+            pos += table_size(f, n);
+        }
+        return out;
+    }
+
+    static void render_value(std::string & out, uint64_t const * v, bool is_bool, unsigned width) {
+        if (is_bool) {
+            out += v[0] ? '1' : '0';
+        } else {
+            for (unsigned i = (width + 3) / 4; i > 0; --i) {
+                unsigned b = 4 * (i - 1);
+                out += "0123456789abcdef"[(v[b / 64] >> (b % 64)) & 15];
+            }
+        }
+        out += '\0';
+    }
+
+private:
+    static unsigned width_of(z3::sort const & s) {
+        return s.is_bv() ? s.bv_size() : 1;
+    }
+
+    void add_arg(Field & f, z3::sort const & s) {
+        f.arg_bool.push_back(s.is_bool());
+        f.arg_width.push_back(width_of(s));
+        f.key_words += nwords(width_of(s));
+    }
+
+    void set_value(Field & f, z3::sort const & s) {
+        f.is_bool = s.is_bool();
+        f.width = width_of(s);
+        f.val_words = nwords(f.width);
+    }
+
+    static int compare_keys(uint64_t const * a, uint64_t const * b, unsigned n) {
+        for (unsigned k = 0; k < n; ++k) {
+            if (a[k] != b[k])
+                return a[k] < b[k] ? -1 : 1;
+        }
+        return 0;
+    }
+
+    // Merges three tables entry by entry; an argument missing from one of
+    // them takes its default value there.
+    void combine_table(Field const & f, Sample const & a, size_t pa, Sample const & b, size_t pb,
+                       Sample const & c, size_t pc, Sample & r) const {
+        unsigned kw = f.key_words;
+        unsigned vw = f.val_words;
+        size_t size = kw + vw;
+        size_t head = r.size();
+        r.push_back(0);
+        r.resize(r.size() + vw);
+        combine_words(&a[pa + 1], &b[pb + 1], &c[pc + 1], &r[head + 1], vw);
+        size_t ia = 0, ib = 0, ic = 0;
+        size_t na = a[pa], nb = b[pb], nc = c[pc];
+        uint64_t const * ea = &a[pa + 1 + vw];
+        uint64_t const * eb = &b[pb + 1 + vw];
+        uint64_t const * ec = &c[pc + 1 + vw];
+        uint64_t n = 0;
+        while (ia < na || ib < nb || ic < nc) {
+            uint64_t const * key = NULL;
+            if (ia < na)
+                key = ea + ia * size;
+            if (ib < nb && (!key || compare_keys(eb + ib * size, key, kw) < 0))
+                key = eb + ib * size;
+            if (ic < nc && (!key || compare_keys(ec + ic * size, key, kw) < 0))
+                key = ec + ic * size;
+            uint64_t const * va = &a[pa + 1];
+            uint64_t const * vb = &b[pb + 1];
+            uint64_t const * vc = &c[pc + 1];
+            std::vector<uint64_t> k(key, key + kw);
+            if (ia < na && compare_keys(ea + ia * size, k.data(), kw) == 0)
+                va = ea + ia++ * size + kw;
+            if (ib < nb && compare_keys(eb + ib * size, k.data(), kw) == 0)
+                vb = eb + ib++ * size + kw;
+            if (ic < nc && compare_keys(ec + ic * size, k.data(), kw) == 0)
+                vc = ec + ic++ * size + kw;
+            size_t e = r.size();
+            r.insert(r.end(), k.begin(), k.end());
+            r.resize(r.size() + vw);
+            combine_words(va, vb, vc, &r[e + kw], vw);
+            ++n;
+        }
+        r[head] = n;
+    }
+
+    static void combine_words(uint64_t const * a, uint64_t const * b, uint64_t const * c, uint64_t * r, unsigned n) {
+        for (unsigned k = 0; k < n; ++k)
+            r[k] = a[k] ^ ((a[k] ^ b[k]) | (a[k] ^ c[k]));
+    }
+};
+
+#endif
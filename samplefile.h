@@ -0,0 +1,350 @@
+#ifndef SAMPLEFILE_H
+#define SAMPLEFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include "sample.h"
+
+// Binary samples file, in host byte order:
+//
+//   header   "SMTSMPv1", then the uint32s version, number of variables,
+//            words of constants and number of tables, then for every
+//            variable its kind (0 constant, 1 array, 2 function), whether
+//            its value is a Bool, its width, its bit offset, its arity, a
+//            (Bool, width) pair per argument and its name as a length and
+//            bytes; padded with zeros to 8 bytes
+//   records  one per sample, all of the same size: the number of
+//            mutations, the words of constants of SampleLayout, and for
+//            every table its offset in words in the table section
+//   tables   the tables of the samples, in the layout of SampleLayout,
+//            kept in the file name.tables until the file is closed
+//   footer   the uint64s offset of the records, number of records and
+//            offset of the tables, then "SMTSMPv1"
+//
+// The records can be read in place by mapping the file.
+#define SAMPLE_FILE_MAGIC "SMTSMPv1"
+
+enum {
+    SAMPLE_CONST,
+    SAMPLE_ARRAY,
+    SAMPLE_FUNCTION
+};
+
+class SampleFileWriter {
+    FILE * file = NULL;
+    FILE * tables = NULL;
+    std::string tables_name;
+    SampleLayout layout;
+    unsigned num_tables = 0;
+    uint64_t records_offset = 0;
+    uint64_t count = 0;
+    uint64_t table_words = 0;
+    std::vector<uint64_t> record;
+
+public:
+    bool open(std::string const & name, std::vector<std::string> const & names, SampleLayout const & sample_layout) {
+        std::string h = header(names, sample_layout);
+        file = fopen(name.c_str(), "wb");
+        tables_name = name + ".tables";
+        tables = fopen(tables_name.c_str(), "w+b");
+        if (!file || !tables)
+            return false;
+        fwrite(h.data(), 1, h.size(), file);
+        return true;
+    }
+
+    // Continues the file of a run with the same variables after its first
+    // num_records records and num_words words of tables, whether that run
+    // closed the file or not.
+    bool resume(std::string const & name, std::vector<std::string> const & names, SampleLayout const & sample_layout, uint64_t num_records, uint64_t num_words) {
+        std::string h = header(names, sample_layout);
+        file = fopen(name.c_str(), "r+b");
+        if (!file)
+            return false;
+        std::string head(h.size(), '\0');
+        if (fread(&head[0], 1, h.size(), file) != h.size() || head != h)
+            return false;
+        uint64_t end = records_offset + num_records * record.size() * sizeof(uint64_t);
+        tables_name = name + ".tables";
+        tables = fopen(tables_name.c_str(), "r+b");
+        if (!tables) {
+            // The file was closed, with its tables after the records.
+            tables = fopen(tables_name.c_str(), "w+b");
+            if (!tables || fseek(file, end, SEEK_SET))
+                return false;
+            std::vector<uint64_t> buffer(num_words);
+            if (fread(buffer.data(), sizeof(uint64_t), num_words, file) != num_words)
+                return false;
+            fwrite(buffer.data(), sizeof(uint64_t), num_words, tables);
+            fflush(tables);
+        }
+        if (ftruncate(fileno(file), end) || ftruncate(fileno(tables), num_words * sizeof(uint64_t)))
+            return false;
+        fseek(file, 0, SEEK_END);
+        fseek(tables, 0, SEEK_END);
+        count = num_records;
+        table_words = num_words;
+        return true;
+    }
+
+    uint64_t records() const {
+        return count;
+    }
+
+    uint64_t words() const {
+        return table_words;
+    }
+
+    // Pushes what was written so far to the files.
+    void flush() {
+        fflush(file);
+        fflush(tables);
+    }
+
+    void write(int nmut, Sample const & sample) {
+        record[0] = nmut;
+        std::copy(sample.begin(), sample.begin() + layout.words, record.begin() + 1);
+        size_t pos = layout.words;
+        unsigned t = 0;
+        for (SampleLayout::Field const & f : layout.fields) {
+            if (!f.is_table)
+                continue;
+            size_t size = SampleLayout::table_size(f, sample[pos]);
+            record[1 + layout.words + t++] = table_words;
+            fwrite(&sample[pos], sizeof(uint64_t), size, tables);
+            table_words += size;
+            pos += size;
+        }
+        fwrite(record.data(), sizeof(uint64_t), record.size(), file);
+        ++count;
+    }
+
+    // Appends the tables and the footer.
+    void close() {
+        uint64_t tables_offset = records_offset + count * record.size() * sizeof(uint64_t);
+        rewind(tables);
+        char buffer[1 << 16];
+        size_t n;
+        while ((n = fread(buffer, 1, sizeof(buffer), tables)) > 0)
+            fwrite(buffer, 1, n, file);
+        fclose(tables);
+        unlink(tables_name.c_str());
+        uint64_t footer[3] = { records_offset, count, tables_offset };
+        fwrite(footer, sizeof(uint64_t), 3, file);
+        fwrite(SAMPLE_FILE_MAGIC, 1, 8, file);
+        fclose(file);
+    }
+
+private:
+    // Sets up the layout and returns the header of the file.
+    std::string header(std::vector<std::string> const & names, SampleLayout const & sample_layout) {
+        layout = sample_layout;
+        num_tables = 0;
+        for (SampleLayout::Field const & f : layout.fields)
+            num_tables += f.is_table;
+        std::string out = SAMPLE_FILE_MAGIC;
+        std::vector<uint32_t> h;
+        h.push_back(1);
+        h.push_back(layout.fields.size());
+        h.push_back(layout.words);
+        h.push_back(num_tables);
+        out.append((char const *)h.data(), h.size() * sizeof(uint32_t));
+        for (unsigned i = 0; i < layout.fields.size(); ++i) {
+            SampleLayout::Field const & f = layout.fields[i];
+            h.clear();
+            h.push_back(f.is_array ? SAMPLE_ARRAY : f.is_table ? SAMPLE_FUNCTION : SAMPLE_CONST);
+            h.push_back(f.is_bool);
+            h.push_back(f.width);
+            h.push_back(f.offset);
+            h.push_back(f.arg_width.size());
+            for (unsigned k = 0; k < f.arg_width.size(); ++k) {
+                h.push_back(f.arg_bool[k]);
+                h.push_back(f.arg_width[k]);
+            }
+            h.push_back(names[i].size());
+            out.append((char const *)h.data(), h.size() * sizeof(uint32_t));
+            out += names[i];
+        }
+        out.resize((out.size() + 7) / 8 * 8, '\0');
+        records_offset = out.size();
+        record.resize(1 + layout.words + num_tables);
+        return out;
+    }
+};
+
+// Maps a binary samples file and gives random access to its samples. The
+// offsets and sizes in the file are all checked by open(), so that a
+// truncated or corrupt file is refused rather than read out of bounds.
+class SampleFileReader {
+    uint8_t const * data = NULL;
+    size_t length = 0;
+    uint64_t const * records = NULL;
+    uint64_t const * tables = NULL;
+    uint64_t count = 0;
+    unsigned num_tables = 0;
+
+public:
+    SampleLayout layout;
+    std::vector<std::string> names;
+    // Why open() failed.
+    std::string error;
+
+    ~SampleFileReader() {
+        if (data)
+            munmap((void *)data, length);
+    }
+
+    bool open(std::string const & name) {
+        int fd = ::open(name.c_str(), O_RDONLY);
+        if (fd < 0)
+            return fail("cannot open the file");
+        struct stat st;
+        if (fstat(fd, &st) < 0 || st.st_size < 8 + 16 + 32) {
+            ::close(fd);
+            return fail("too short for a samples file");
+        }
+        length = st.st_size;
+        void * p = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED)
+            return fail("cannot map the file");
+        data = (uint8_t const *)p;
+        if (memcmp(data, SAMPLE_FILE_MAGIC, 8) || memcmp(data + length - 8, SAMPLE_FILE_MAGIC, 8))
+            return fail("not a samples file, or not closed");
+        uint64_t footer[3];
+        memcpy(footer, data + length - 32, sizeof(footer));
+        uint64_t end = length - 32;
+        if (footer[0] % 8 || footer[2] % 8 || footer[0] < 8 + 16 || footer[0] > footer[2] || footer[2] > end)
+            return fail("offsets of the footer out of the file");
+        if (!read_header((char const *)data + 8, (char const *)data + footer[0]))
+            return false;
+        count = footer[1];
+        uint64_t record_bytes = record_words() * sizeof(uint64_t);
+        if (count > (footer[2] - footer[0]) / record_bytes || count * record_bytes != footer[2] - footer[0])
+            return fail("records do not match the footer");
+        records = (uint64_t const *)(data + footer[0]);
+        tables = (uint64_t const *)(data + footer[2]);
+        uint64_t table_words = (end - footer[2]) / sizeof(uint64_t);
+        for (uint64_t i = 0; i < count; ++i) {
+            unsigned t = 0;
+            for (SampleLayout::Field const & f : layout.fields) {
+                if (!f.is_table)
+                    continue;
+                uint64_t offset = record(i)[1 + layout.words + t++];
+                if (offset >= table_words || table_words - offset < 1 + f.val_words)
+                    return fail("table of sample " + std::to_string(i) + " out of the file");
+                uint64_t left = table_words - offset - 1 - f.val_words;
+                if (tables[offset] > left / (f.key_words + f.val_words))
+                    return fail("table of sample " + std::to_string(i) + " out of the file");
+            }
+        }
+        return true;
+    }
+
+    uint64_t size() const {
+        return count;
+    }
+
+    size_t record_words() const {
+        return 1 + layout.words + num_tables;
+    }
+
+    // The record of sample i, in place: the number of mutations, the words
+    // of constants and the offsets of the tables.
+    uint64_t const * record(uint64_t i) const {
+        return records + i * record_words();
+    }
+
+    uint64_t const * table(uint64_t i, unsigned t) const {
+        return tables + record(i)[1 + layout.words + t];
+    }
+
+    int mutations(uint64_t i) const {
+        return record(i)[0];
+    }
+
+    // Copy of sample i as a Sample of layout.
+    Sample sample(uint64_t i) const {
+        uint64_t const * r = record(i);
+        Sample s(r + 1, r + 1 + layout.words);
+        unsigned t = 0;
+        for (SampleLayout::Field const & f : layout.fields) {
+            if (!f.is_table)
+                continue;
+            uint64_t const * p = table(i, t++);
+            s.insert(s.end(), p, p + SampleLayout::table_size(f, p[0]));
+        }
+        return s;
+    }
+
+private:
+    bool fail(std::string const & message) {
+        error = message;
+        return false;
+    }
+
+    // Reads the variables from the header, which ends at end.
+    bool read_header(char const * h, char const * end) {
+        uint32_t version, num_vars, words, tables_count;
+        if (!read32(h, end, version) || version != 1)
+            return fail("unknown version");
+        if (!read32(h, end, num_vars) || !read32(h, end, words) || !read32(h, end, tables_count))
+            return fail("header out of the file");
+        layout.words = words;
+        num_tables = tables_count;
+        unsigned found_tables = 0;
+        for (unsigned i = 0; i < num_vars; ++i) {
+            SampleLayout::Field f;
+            uint32_t kind, is_bool, width, offset, arity, len;
+            if (!read32(h, end, kind) || !read32(h, end, is_bool) || !read32(h, end, width) || !read32(h, end, offset) || !read32(h, end, arity))
+                return fail("header out of the file");
+            if (kind > SAMPLE_FUNCTION || width == 0)
+                return fail("bad sort of variable " + std::to_string(i));
+            f.is_array = kind == SAMPLE_ARRAY;
+            f.is_table = kind != SAMPLE_CONST;
+            f.is_bool = is_bool;
+            f.width = width;
+            f.offset = offset;
+            if (!f.is_table && (uint64_t)offset + width > (uint64_t)words * 64)
+                return fail("variable " + std::to_string(i) + " out of the record");
+            found_tables += f.is_table;
+            f.key_words = 0;
+            for (unsigned k = 0; k < arity; ++k) {
+                uint32_t b, w;
+                if (!read32(h, end, b) || !read32(h, end, w))
+                    return fail("header out of the file");
+                if (w == 0)
+                    return fail("bad sort of variable " + std::to_string(i));
+                f.arg_bool.push_back(b);
+                f.arg_width.push_back(w);
+                f.key_words += SampleLayout::nwords(w);
+            }
+            f.val_words = SampleLayout::nwords(f.width);
+            if (!read32(h, end, len) || len > (size_t)(end - h))
+                return fail("header out of the file");
+            names.push_back(std::string(h, len));
+            h += len;
+            layout.fields.push_back(f);
+        }
+        if (found_tables != num_tables)
+            return fail("number of tables does not match the variables");
+        return true;
+    }
+
+    static bool read32(char const * & p, char const * end, uint32_t & v) {
+        if (end - p < (ptrdiff_t)sizeof(v))
+            return false;
+        memcpy(&v, p, sizeof(v));
+        p += sizeof(v);
+        return true;
+    }
+};
+
+#endif
@@ -1,49 +1,568 @@
 #include <string.h>
+#include <limits.h>
 #include <z3++.h>
 #include <vector>
 #include <map>
+#include <set>
 #include <unordered_set>
 #include <unordered_map>
 #include <algorithm>
 #include <fstream>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <deque>
+#include <queue>
+#include <condition_variable>
+#include <functional>
+#include "sample.h"
+#include "evaluator.h"
+#include "samplefile.h"
+#include "stats.h"
+#include "checkpoint.h"
+#include "formulacache.h"
+#include "smtsampler.h"
+
+void coverage_set_mode(Z3_context ctx, int mode);
+void coverage_counts(Z3_context ctx, unsigned * counts);
+void coverage_merge(Z3_context dst, Z3_context src);
+void coverage_save(Z3_context ctx, std::vector<uint64_t> & words);
+bool coverage_load(Z3_context ctx, std::vector<uint64_t> const & words);
+void coverage_release(Z3_context ctx);
 
-enum {
-STRAT_SMTBIT,
-STRAT_SMTBV,
-STRAT_SAT
+Z3_ast parse_bv(char const * n, Z3_sort s, Z3_context ctx);
+std::string bv_string(Z3_ast ast, Z3_context ctx);
+
+// Thrown by finish() to unwind a worker once sampling has to stop.
+struct stop_sampling {};
+
+// Thrown when the run cannot go on, with the message and exit status of the
+// command line tool.
+struct sampler_error {
+    std::string message;
+    int status;
 };
 
-extern int coverage_enable;
-extern int coverage_bool;
-extern int coverage_bv;
-extern int coverage_all_bool;
-extern int coverage_all_bv;
+// Work-stealing queue of the flip indices of an epoch. Every flip worker
+// owns a contiguous range, pops from its front and, once it is empty,
+// steals from the back of the others.
+class FlipQueue {
+    std::vector<std::deque<int>> queues;
+    std::vector<std::mutex> locks;
+    std::atomic<int> left;
 
-Z3_ast parse_bv(char const * n, Z3_sort s, Z3_context ctx);
-std::string bv_string(Z3_ast ast, Z3_context ctx);
+public:
+    FlipQueue(int workers, int size) : queues(workers), locks(workers), left(size) {
+        for (int i = 0; i < size; ++i) {
+            queues[(long)i * workers / size].push_back(i);
+        }
+    }
+
+    int remaining() {
+        return left;
+    }
+
+    bool pop(int id, int & index) {
+        for (int k = 0; k < queues.size(); ++k) {
+            int victim = (id + k) % queues.size();
+            std::lock_guard<std::mutex> lock(locks[victim]);
+            std::deque<int> & q = queues[victim];
+            if (q.empty())
+                continue;
+            if (k == 0) {
+                index = q.front();
+                q.pop_front();
+            } else {
+                index = q.back();
+                q.pop_back();
+            }
+            --left;
+            return true;
+        }
+        return false;
+    }
+};
+
+// A valid combination of the flips of an epoch, the flips in it as indices
+// into them, and the estimated chance that it was valid. Its cone is the
+// set of conjuncts of the formula that the flips change variables of, and
+// disjoint tells whether its last flip shared none with the others.
+struct Combination {
+    Sample sample;
+    std::vector<int> parts;
+    double score;
+    std::vector<uint64_t> cone;
+    bool disjoint;
+};
+
+// Pairs of a valid combination of the last level and a flip of the epoch.
+// A pair whose cones are disjoint changes every conjunct as one of its two
+// valid halves does, and so is valid itself; those come first for each
+// combination, and then the others in order of the product of their
+// scores. The heap holds the next pair of each combination.
+class CombinationQueue {
+    std::vector<Combination> const & base;
+    std::vector<double> const & scores;
+    std::vector<std::vector<uint64_t>> const & cones;
+    std::vector<int> flips;
+    std::priority_queue<std::pair<double, std::pair<int, int>>> heap;
+
+    bool disjoint(int b, int f) const {
+        std::vector<uint64_t> const & x = base[b].cone;
+        std::vector<uint64_t> const & y = cones[f];
+        for (size_t k = 0; k < x.size(); ++k) {
+            if (x[k] & y[k])
+                return false;
+        }
+        return true;
+    }
+
+    // Queues the pair of combination b at position pos or after it, where
+    // the first pass over the flips takes the disjoint ones and the second
+    // the others.
+    void advance(int b, int pos) {
+        int n = flips.size();
+        for (; pos < 2 * n; ++pos) {
+            int f = flips[pos % n];
+            bool d = !cones.empty() && disjoint(b, f);
+            if (d == (pos < n)) {
+                heap.push(std::make_pair(base[b].score * (d ? 1.0 : scores[f]), std::make_pair(b, pos)));
+                return;
+            }
+        }
+    }
+
+public:
+    // Without cones, every pair is taken as sharing conjuncts.
+    CombinationQueue(std::vector<Combination> const & b, std::vector<double> const & s, std::vector<std::vector<uint64_t>> const & c) : base(b), scores(s), cones(c), flips(s.size()) {
+        for (int i = 0; i < flips.size(); ++i)
+            flips[i] = i;
+        std::stable_sort(flips.begin(), flips.end(), [&](int x, int y) { return scores[x] > scores[y]; });
+        for (int i = 0; i < base.size(); ++i)
+            advance(i, cones.empty() ? flips.size() : 0);
+    }
+
+    bool pop(int & combination, int & flip, bool & disjoint) {
+        if (heap.empty())
+            return false;
+        std::pair<int, int> top = heap.top().second;
+        heap.pop();
+        combination = top.first;
+        flip = flips[top.second % flips.size()];
+        disjoint = top.second < flips.size();
+        advance(top.first, top.second + 1);
+        return true;
+    }
+};
+
+// Threads that run a task along with the calling thread. run() hands the
+// task to every thread, with its id, and returns once all are done.
+class WorkerPool {
+    std::vector<std::thread> threads;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::function<void(int)> task;
+    uint64_t generation = 0;
+    int busy = 0;
+    bool quit = false;
+
+    void loop(int id) {
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> guard(lock);
+        while (true) {
+            wake.wait(guard, [&] { return quit || generation != seen; });
+            if (quit)
+                return;
+            seen = generation;
+            guard.unlock();
+            task(id);
+            guard.lock();
+            if (--busy == 0)
+                done.notify_one();
+        }
+    }
+
+public:
+    WorkerPool(int size) {
+        for (int i = 1; i < size; ++i)
+            threads.emplace_back(&WorkerPool::loop, this, i);
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            quit = true;
+        }
+        wake.notify_all();
+        for (std::thread & t : threads)
+            t.join();
+    }
 
-typedef struct {
-    char const * a[3] = {NULL, NULL, NULL};
-} triple;
+    int size() const {
+        return threads.size() + 1;
+    }
+
+    void run(std::function<void(int)> const & f) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            task = f;
+            busy = threads.size();
+            ++generation;
+        }
+        wake.notify_all();
+        f(0);
+        std::unique_lock<std::mutex> guard(lock);
+        done.wait(guard, [&] { return busy == 0; });
+    }
+};
+
+// xoshiro256** generator, seeded through splitmix64. Every sampler has its
+// own, so drawing takes no lock.
+class Random {
+    uint64_t s[4];
+
+    static uint64_t rotl(uint64_t x, int k) {
+        return (x << k) | (x >> (64 - k));
+    }
+
+public:
+    void seed(uint64_t x) {
+        for (int i = 0; i < 4; ++i) {
+            x += 0x9e3779b97f4a7c15ull;
+            uint64_t z = x;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            s[i] = z ^ (z >> 31);
+        }
+    }
+
+    uint64_t next() {
+        uint64_t r = rotl(s[1] * 5, 7) * 9;
+        uint64_t t = s[1] << 17;
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+        return r;
+    }
+
+    // Uniform in [0, 1).
+    double uniform() {
+        return (next() >> 11) * (1.0 / (1ull << 53));
+    }
+};
+
+// Durations of the last solver calls of a sampler.
+class LatencyWindow {
+    std::vector<double> times;
+    size_t next = 0;
+    unsigned count = 0;
+
+public:
+    static const size_t size = 256;
+
+    void add(double t) {
+        if (times.size() < size)
+            times.push_back(t);
+        else
+            times[next] = t;
+        next = (next + 1) % size;
+        ++count;
+    }
+
+    unsigned calls() const {
+        return count;
+    }
+
+    double p95() const {
+        std::vector<double> sorted = times;
+        size_t k = sorted.size() * 95 / 100;
+        std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+        return sorted[k];
+    }
+};
+
+// Writes the samples file from its own thread, so that formatting and disk
+// writes do not hold up sampling. Samples are queued in a buffer that the
+// writer swaps out and writes in blocks of about a megabyte, or as records
+// of a binary samples file.
+class SampleWriter {
+    std::ofstream file;
+    SampleFileWriter binary_file;
+    bool binary = false;
+    SampleLayout layout;
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::condition_variable drained;
+    std::condition_variable idle;
+    std::vector<std::pair<int, Sample>> queue;
+    bool done = false;
+    bool busy = false;
+    uint64_t lines = 0;
+    uint64_t bytes = 0;
+    std::thread thread;
+
+    static const size_t max_queue = 1 << 16;
+    static const size_t block_size = 1 << 20;
+
+public:
+    void open(std::string const & name, SampleLayout const & sample_layout) {
+        file.open(name);
+        layout = sample_layout;
+        thread = std::thread(&SampleWriter::run, this);
+    }
+
+    bool open_binary(std::string const & name, SampleLayout const & sample_layout, std::vector<std::string> const & names) {
+        if (!binary_file.open(name, names, sample_layout)) {
+            return false;
+        }
+        binary = true;
+        layout = sample_layout;
+        thread = std::thread(&SampleWriter::run, this);
+        return true;
+    }
+
+    // Continues a text samples file after its first lines and bytes.
+    bool resume(std::string const & name, SampleLayout const & sample_layout, uint64_t num_lines, uint64_t num_bytes) {
+        if (truncate(name.c_str(), num_bytes))
+            return false;
+        file.open(name, std::ios::app);
+        lines = num_lines;
+        bytes = num_bytes;
+        layout = sample_layout;
+        thread = std::thread(&SampleWriter::run, this);
+        return true;
+    }
+
+    bool resume_binary(std::string const & name, SampleLayout const & sample_layout, std::vector<std::string> const & names, uint64_t records, uint64_t words) {
+        if (!binary_file.resume(name, names, sample_layout, records, words))
+            return false;
+        binary = true;
+        layout = sample_layout;
+        thread = std::thread(&SampleWriter::run, this);
+        return true;
+    }
+
+    // Waits until everything queued is written and flushed, and gives the
+    // size of the file: lines and bytes of a text file, or records and words
+    // of tables of a binary file.
+    void sync(uint64_t * position) {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this] { return queue.empty() && !busy; });
+        if (binary) {
+            binary_file.flush();
+            position[0] = binary_file.records();
+            position[1] = binary_file.words();
+        } else {
+            file.flush();
+            position[0] = lines;
+            position[1] = bytes;
+        }
+    }
+
+    // Only waits for the writer if it has fallen far behind.
+    void push(int nmut, Sample const & sample) {
+        std::unique_lock<std::mutex> lock(mutex);
+        drained.wait(lock, [this] { return queue.size() < max_queue || done; });
+        queue.emplace_back(nmut, sample);
+        if (queue.size() == 1)
+            ready.notify_one();
+    }
+
+    // Writes out everything queued so far and closes the file, if one was
+    // opened.
+    void close() {
+        if (!thread.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (done)
+                return;
+            done = true;
+        }
+        ready.notify_one();
+        thread.join();
+        if (binary)
+            binary_file.close();
+        else
+            file.close();
+    }
+
+private:
+    void run() {
+        std::vector<std::pair<int, Sample>> batch;
+        std::string block;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ready.wait(lock, [this] { return done || !queue.empty(); });
+                if (queue.empty())
+                    break;
+                batch.swap(queue);
+                busy = true;
+            }
+            drained.notify_all();
+            if (binary) {
+                for (std::pair<int, Sample> & entry : batch)
+                    binary_file.write(entry.first, entry.second);
+            } else {
+                for (std::pair<int, Sample> & entry : batch) {
+                    block += std::to_string(entry.first);
+                    block += ": ";
+                    block += layout.render(entry.second);
+                    block += '\n';
+                    if (block.size() >= block_size) {
+                        file.write(block.data(), block.size());
+                        bytes += block.size();
+                        block.clear();
+                    }
+                }
+                file.write(block.data(), block.size());
+                bytes += block.size();
+                lines += batch.size();
+                block.clear();
+            }
+            batch.clear();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                busy = false;
+            }
+            idle.notify_all();
+        }
+        if (!binary)
+            file.flush();
+    }
+};
+
+// Samples on their way from the samplers to Sampler::next(), bounded so
+// that sampling keeps only a little ahead of the program taking them.
+class SampleQueue {
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::condition_variable drained;
+    std::deque<std::pair<int, Sample>> queue;
+    bool done = false;
+    bool closed = false;
+
+    static const size_t max_queue = 1 << 10;
+
+public:
+    void push(int nmut, Sample const & sample) {
+        std::unique_lock<std::mutex> lock(mutex);
+        drained.wait(lock, [this] { return queue.size() < max_queue || closed; });
+        if (closed)
+            return;
+        queue.emplace_back(nmut, sample);
+        ready.notify_one();
+    }
+
+    bool pop(Sample & sample, int & nmut) {
+        std::unique_lock<std::mutex> lock(mutex);
+        ready.wait(lock, [this] { return !queue.empty() || done || closed; });
+        if (queue.empty() || closed)
+            return false;
+        nmut = queue.front().first;
+        sample.swap(queue.front().second);
+        queue.pop_front();
+        drained.notify_one();
+        return true;
+    }
+
+    // No more samples are coming, though those queued can still be taken.
+    void finish() {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+        ready.notify_all();
+    }
+
+    // Nobody takes samples any more: drops those queued and those to come.
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        queue.clear();
+        ready.notify_all();
+        drained.notify_all();
+    }
+};
+
+// State shared by all the workers of a run: the samples found so far and
+// the stream they are written to.
+struct SampleStore {
+    std::mutex mutex;
+    SampleSet all_mutations;
+    SampleWriter writer;
+    std::atomic<int> samples{0};
+    std::atomic<int> valid_samples{0};
+    std::atomic<bool> stop{false};
+    std::vector<Z3_context> contexts;
+    // The samplers of the components of --components keep their unique
+    // samples here instead of writing them, with their numbers of
+    // mutations.
+    bool collect = false;
+    std::vector<Sample> collected;
+    std::vector<int> collected_nmut;
+    // Takes the samples instead of the writer after Sampler::start().
+    SampleQueue * queue = NULL;
+    // The first error of the run, which stopped it.
+    bool failed = false;
+    sampler_error error;
+    // Stats of each job as of its last epoch, with its known unsat flips
+    // and coverage when checkpointing.
+    std::vector<SamplerStats> published;
+    std::vector<std::unordered_map<int, std::unordered_set<int>>> published_unsat;
+    std::vector<std::vector<uint64_t>> published_coverage;
+};
+
+// Drops whatever is written to it, having no buffer.
+static std::ostream null_stream(NULL);
 
 class SMTSampler {
     std::string input_file;
 
-    struct timespec start_time;
-    double solver_time = 0.0;
-    double check_time = 0.0;
-    double cov_time = 0.0;
-    double convert_time = 0.0;
+    double start_time;
+    SamplerStats stats;
+    std::string stats_json;
+    double last_json = 0.0;
+    int job = 0;
+    double checkpoint_interval = 0.0;
+    double last_checkpoint = 0.0;
+    bool resume = false;
+    uint64_t formula_hash = 0;
+    std::string cache_dir;
+    FormulaCache const * cache = NULL;
+    bool own_cache = false;
     int max_samples;
     double max_time;
+    int jobs = 1;
+    uint64_t seed = 0;
+    bool has_seed = false;
+    Random random;
+    // Workers leave the progress and stats to the master.
+    bool quiet = false;
+    // Where messages are printed: stdout, or nowhere with Options::quiet
+    // and after Sampler::start().
+    std::ostream * out = &std::cout;
+    bool exact_dedupe = false;
+    bool binary = false;
+    bool use_assumptions = false;
+    unsigned timeout = 5000;
+    unsigned max_timeout = 5000;
+    unsigned solver_timeout = 0;
+    bool adaptive_timeout = true;
+    LatencyWindow latencies;
 
     z3::context c;
     int strategy;
+    int engine = ENGINE_OPT;
     bool convert = false;
     bool const flip_internal = false;
     bool random_soft_bit = false;
-    z3::apply_result * res0;
-    z3::goal * converted_goal;
+    z3::apply_result * res0 = NULL;
+    z3::goal * converted_goal = NULL;
     z3::params params;
     z3::optimize opt;
     z3::solver solver;
@@ -51,50 +570,430 @@ class SMTSampler {
     z3::expr smt_formula;
     std::vector<z3::func_decl> variables;
     std::vector<z3::func_decl> ind;
+    SampleLayout var_layout;
+    SampleLayout ind_layout;
     std::vector<z3::expr> internal;
     std::vector<z3::expr> constraints;
+    std::vector<z3::expr> flip_literals;
+    std::vector<z3::expr> soft_literals;
+    std::vector<size_t> soft_scopes;
     std::vector<std::vector<z3::expr>> soft_constraints;
     std::vector<std::pair<int,int>> cons_to_ind;
+    // With the relax engine, the constraint of each soft literal of a bit,
+    // and the soft literals dropped by the last call to relax().
+    std::unordered_map<Z3_ast, int> soft_owner;
+    std::vector<z3::expr> relaxed;
+    Evaluator evaluator;
+    BatchEvaluator batch;
     std::unordered_map<int, std::unordered_set<int>> unsat_ind;
     std::unordered_set<int> unsat_internal;
-    std::unordered_set<std::string> all_mutations;
-    int epochs = 0;
-    int flips = 0;
-    int samples = 0;
-    int valid_samples = 0;
-    int solver_calls = 0;
-    int unsat_ind_count = 0;
     int all_ind_count = 0;
-
-    std::ofstream results_file;
+    // Candidates per epoch, or 0 to combine while that gives valid samples
+    // faster than the flips.
+    long combine_budget = 0;
+    // Combinations tried and found valid with the flip of each bit, by
+    // variable and bit.
+    std::unordered_map<int, std::unordered_map<int, std::pair<int, int>>> flip_yield;
+    // Top-level conjuncts of the formula that every variable occurs in, as
+    // a set of at most 4096 classes of conjuncts, or none if unknown.
+    std::vector<std::vector<uint64_t>> var_cones;
+    // Bits of the constants of ind that have the same value in every
+    // solution, and those values, as samples of ind; empty if not searched.
+    bool find_backbone_bits = false;
+    bool components = false;
+    Sample backbone_mask;
+    Sample backbone_value;
+
+    SampleStore * store;
+    bool own_store = false;
+    std::vector<SMTSampler *> workers;
+    std::vector<SMTSampler *> group_samplers;
+    int flip_jobs = 1;
+    std::vector<SMTSampler *> flip_workers;
+    int check_jobs = 1;
+    std::vector<SMTSampler *> check_workers;
+    WorkerPool * check_pool = NULL;
+
+    friend class Sampler;
 
 public:
-    SMTSampler(std::string input, int max_samples, double max_time, int strategy) : opt(c), params(c), solver(c), model(c), smt_formula(c), input_file(input), max_samples(max_samples), max_time(max_time), strategy(strategy) {
+    SMTSampler(std::string input, Options const & o) : opt(c), params(c), solver(c), model(c), smt_formula(c), input_file(input), max_samples(o.max_samples), max_time(o.max_time), strategy(o.strategy), engine(o.engine), jobs(o.jobs), flip_jobs(o.flip_jobs), check_jobs(o.check_jobs), exact_dedupe(o.exact_dedupe), binary(o.binary), use_assumptions(o.assumptions), timeout(o.timeout), max_timeout(o.timeout), adaptive_timeout(o.adaptive_timeout), stats_json(o.stats_json), seed(o.seed), has_seed(o.has_seed), checkpoint_interval(o.checkpoint), resume(o.resume), cache_dir(o.cache_dir), combine_budget(o.combine_budget), find_backbone_bits(o.backbone), components(o.components) {
         z3::set_param("rewriter.expand_select_store", "true");
-        params.set("timeout", 5000u);
-        opt.set(params);
-        solver.set(params);
+        use_timeout(max_timeout);
         convert = strategy == STRAT_SAT;
+        store = new SampleStore();
+        own_store = true;
+        store->all_mutations = SampleSet(exact_dedupe);
+        if (o.quiet)
+            out = &null_stream;
+        register_context();
     }
 
-    void run() {
-        clock_gettime(CLOCK_REALTIME, &start_time);
-        srand(start_time.tv_sec);
+    // Worker of a multi-threaded run: works on its own copy of the formula
+    // already parsed by master, and shares master's sample store.
+    SMTSampler(SMTSampler & master, uint64_t seed) : SMTSampler(master, seed, master.smt_formula) {}
+
+    // Worker on formula, a formula in master's context, such as the
+    // conjuncts of a group of --components.
+    SMTSampler(SMTSampler & master, uint64_t seed, z3::expr const & formula) : opt(c), params(c), solver(c), model(c), smt_formula(c), input_file(master.input_file), max_samples(master.max_samples), max_time(master.max_time), strategy(master.strategy), engine(master.engine), flip_jobs(master.flip_jobs), check_jobs(master.check_jobs), exact_dedupe(master.exact_dedupe), use_assumptions(master.use_assumptions), timeout(master.max_timeout), max_timeout(master.max_timeout), adaptive_timeout(master.adaptive_timeout), combine_budget(master.combine_budget), backbone_mask(master.backbone_mask), backbone_value(master.backbone_value), seed(seed) {
+        use_timeout(max_timeout);
+        random.seed(seed);
+        convert = master.convert;
+        start_time = master.start_time;
+        quiet = true;
+        out = master.out;
+        smt_formula = z3::expr(c, Z3_translate(master.c, formula, c));
+        store = master.store;
+        register_context();
+    }
+
+    // Frees the workers, which have all stopped by then, and the coverage
+    // the patched model evaluator keeps for the context.
+    ~SMTSampler() {
+        for (SMTSampler * w : workers)
+            delete w;
+        for (SMTSampler * w : flip_workers)
+            delete w;
+        for (SMTSampler * w : check_workers)
+            delete w;
+        for (SMTSampler * w : group_samplers)
+            delete w;
+        delete check_pool;
+        delete res0;
+        delete converted_goal;
+        if (own_cache)
+            delete cache;
+        if (own_store) {
+            store->writer.close();
+            delete store;
+        }
+        coverage_release(c);
+    }
+
+    std::ostream & log() {
+        return *out;
+    }
+
+    // Reads the formula and finds its first solution. With to_file, opens
+    // the samples file or resumes the checkpointed run; otherwise the
+    // samples go to store->queue and checkpoints are not made.
+    void begin(bool to_file) {
+        start_time = monotonic_now();
+        if (!has_seed)
+            seed = time(NULL);
+        random.seed(seed);
+        log() << "Seed " << seed << '\n';
+        if (checkpoint_interval > 0 || resume || !cache_dir.empty())
+            formula_hash = file_hash(input_file);
+        if (!cache_dir.empty())
+            load_cache();
         // parse_cnf();
+        if (!to_file) {
+            checkpoint_interval = 0.0;
+            resume = false;
+        }
         parse_smt();
-        results_file.open(input_file + ".samples");
+        if (!to_file || (resume && resume_run())) {
+        } else if (binary) {
+            std::string name = input_file + ".samples.bin";
+            if (!store->writer.open_binary(name, var_layout, variable_names()))
+                throw sampler_error{"Could not open " + name, 1};
+        } else {
+            store->writer.open(input_file + ".samples", var_layout);
+        }
+    }
+
+    // Samples until the run stops, then prints its stats and closes the
+    // samples file. Throws the error that stopped the run, if one did.
+    void sample_all() {
+        if (!components || convert || !sample_components()) {
+            if (find_backbone_bits)
+                find_backbone();
+            sample_jobs();
+        }
+        if (store->failed) {
+            if (!store->queue)
+                store->writer.close();
+            throw store->error;
+        }
+        print_stats();
+        if (!stats_json.empty())
+            write_stats_json(stats, true);
+        if (checkpoint_interval > 0)
+            save_checkpoint(true);
+        if (!store->queue)
+            store->writer.close();
+    }
+
+    // Samples with the jobs of -j, this sampler being the first.
+    void sample_jobs() {
+        // Translation reads the master context, so it is done here before
+        // any thread starts.
+        for (int i = 1; i < jobs; ++i) {
+            workers.push_back(new SMTSampler(*this, seed + 7919 * i));
+            workers.back()->job = i;
+            workers.back()->cache = cache;
+            workers.back()->unsat_ind = unsat_ind;
+            workers.back()->checkpoint_interval = checkpoint_interval;
+        }
+        store->published.resize(jobs);
+        store->published_unsat.resize(jobs);
+        store->published_coverage.resize(jobs);
+        std::vector<std::thread> threads;
+        for (SMTSampler * w : workers) {
+            threads.emplace_back([w] {
+                try {
+                    w->prepare();
+                } catch (stop_sampling) {
+                    return;
+                } catch (sampler_error & e) {
+                    w->fail(e);
+                    return;
+                }
+                w->sample_epochs();
+            });
+        }
+        sample_epochs();
+        for (std::thread & t : threads) {
+            t.join();
+        }
+        for (SMTSampler * w : workers) {
+            stats.merge(w->stats);
+            coverage_merge(c, w->c);
+        }
+    }
+
+    // Samples the components of the formula apart and outputs products of
+    // their samples, each a solution since the components share no
+    // variables. Small components are packed into at most 16 groups, each
+    // sampled in its own thread until it has about the n-th root of twice
+    // max_samples unique samples for n groups, or for half the time left.
+    // Returns false if the formula has a single component, or a group
+    // found no samples.
+    bool sample_components() {
+        std::vector<z3::expr> conjuncts = top_conjuncts();
+        std::vector<std::vector<int>> parts = find_components(conjuncts);
+        if (parts.size() < 2) {
+            log() << "Single component\n";
+            return false;
+        }
+        std::sort(parts.begin(), parts.end(), [](std::vector<int> const & a, std::vector<int> const & b) {
+            return a.size() > b.size();
+        });
+        std::vector<std::vector<int>> groups(std::min<size_t>(parts.size(), 16));
+        for (std::vector<int> const & p : parts) {
+            std::vector<int> * smallest = &groups[0];
+            for (std::vector<int> & g : groups) {
+                if (g.size() < smallest->size())
+                    smallest = &g;
+            }
+            smallest->insert(smallest->end(), p.begin(), p.end());
+        }
+        log() << "Components " << parts.size() << " in " << groups.size() << " groups\n";
+
+        std::vector<SMTSampler *> samplers;
+        for (int g = 0; g < groups.size(); ++g) {
+            z3::expr_vector es(c);
+            for (int k : groups[g])
+                es.push_back(conjuncts[k]);
+            SMTSampler * w = new SMTSampler(*this, seed + 1299709 * (g + 1), z3::mk_and(es));
+            w->max_samples = INT_MAX;
+            w->store = new SampleStore();
+            w->own_store = true;
+            w->store->all_mutations = SampleSet(exact_dedupe);
+            w->store->collect = true;
+            w->register_context();
+            samplers.push_back(w);
+        }
+        group_samplers = samplers;
+        std::vector<std::thread> threads;
+        for (SMTSampler * w : samplers) {
+            threads.emplace_back([w] {
+                try {
+                    w->prepare();
+                } catch (stop_sampling) {
+                    return;
+                } catch (sampler_error & e) {
+                    w->fail(e);
+                    return;
+                }
+                w->sample_epochs();
+            });
+        }
+        size_t target = (size_t)ceil(pow(2.0 * max_samples, 1.0 / groups.size())) + 1;
+        double deadline = elapsed() + (max_time - elapsed()) / 2;
         while (true) {
-            opt.push();
-            solver.push();
-            for (z3::func_decl & v : ind) {
+            bool done = true;
+            for (SMTSampler * w : samplers) {
+                size_t n;
+                {
+                    std::lock_guard<std::mutex> lock(w->store->mutex);
+                    n = w->store->collected.size();
+                }
+                if (n >= target && !w->store->stop)
+                    w->request_stop();
+                done = done && w->store->stop;
+            }
+            if (done)
+                break;
+            if (store->stop || elapsed() >= deadline) {
+                for (SMTSampler * w : samplers)
+                    w->request_stop();
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        for (std::thread & t : threads) {
+            t.join();
+        }
+        // Without samples of every group there are no products, so the
+        // formula is sampled whole instead.
+        for (SMTSampler * w : samplers) {
+            if (store->stop)
+                return true;
+            if (w->store->failed || w->store->collected.empty()) {
+                log() << "A group has no samples, sampling the whole formula\n";
+                return false;
+            }
+        }
+
+        // Where each variable is found among the variables of the groups.
+        std::unordered_map<std::string, std::pair<int, int>> where;
+        for (int g = 0; g < samplers.size(); ++g) {
+            std::vector<std::string> names = samplers[g]->variable_names();
+            for (int j = 0; j < names.size(); ++j)
+                where[names[j]] = std::make_pair(g, j);
+        }
+        std::vector<std::pair<int, int>> origin;
+        for (std::string const & name : variable_names()) {
+            auto it = where.find(name);
+            origin.push_back(it == where.end() ? std::make_pair(-1, -1) : it->second);
+        }
+        double product = 1.0;
+        log() << "Component samples";
+        for (SMTSampler * w : samplers) {
+            // Groups are stopped some time after reaching the target, so
+            // the samples past it are dropped to keep runs reproducible.
+            if (w->store->collected.size() > target) {
+                w->store->collected.resize(target);
+                w->store->collected_nmut.resize(target);
+            }
+            stats.merge(w->stats);
+            product *= w->store->collected.size();
+            log() << ' ' << w->store->collected.size();
+        }
+        log() << '\n';
+
+        // Every product is output when there are few, and otherwise
+        // products are drawn at random. A product is as many mutations
+        // away from the first solution as its samples together.
+        Sample base = model_sample(model, variables, var_layout);
+        std::vector<Sample const *> values(samplers.size());
+        bool enumerate = product <= 4.0 * max_samples;
+        try {
+            for (uint64_t t = 0; ; ++t) {
+                if (store->valid_samples >= max_samples) {
+                    log() << "Stopping: samples\n";
+                    break;
+                }
+                if (enumerate && t >= product) {
+                    log() << "Stopping: products\n";
+                    break;
+                }
+                uint64_t digits = t;
+                int nmut = 0;
+                for (int g = 0; g < samplers.size(); ++g) {
+                    std::vector<Sample> const & collected = samplers[g]->store->collected;
+                    size_t k = enumerate ? digits % collected.size() : random.next() % collected.size();
+                    digits /= collected.size();
+                    values[g] = &collected[k];
+                    nmut += samplers[g]->store->collected_nmut[k];
+                }
+                output(assemble(base, samplers, origin, values), nmut);
+            }
+        } catch (stop_sampling) {
+        }
+        request_stop();
+        return true;
+    }
+
+    // The sample of the variables with the values of the samples of the
+    // groups, or of base for variables in none of them.
+    Sample assemble(Sample const & base, std::vector<SMTSampler *> const & samplers, std::vector<std::pair<int, int>> const & origin, std::vector<Sample const *> const & values) {
+        Sample result(base.begin(), base.begin() + var_layout.words);
+        std::vector<uint64_t> v;
+        size_t pos = var_layout.words;
+        for (int i = 0; i < origin.size(); ++i) {
+            SampleLayout::Field const & f = var_layout.fields[i];
+            int g = origin[i].first;
+            if (f.is_table) {
+                Sample const & from = g < 0 ? base : *values[g];
+                size_t at = g < 0 ? pos : samplers[g]->var_layout.table(from, origin[i].second);
+                size_t size = SampleLayout::table_size(f, from[at]);
+                result.insert(result.end(), from.begin() + at, from.begin() + at + size);
+                pos += SampleLayout::table_size(f, base[pos]);
+            } else if (g >= 0) {
+                SampleLayout const & layout = samplers[g]->var_layout;
+                v.assign(SampleLayout::nwords(f.width), 0);
+                layout.get(*values[g], layout.fields[origin[i].second], v.data());
+                var_layout.set(result, f, v.data());
+            }
+        }
+        return result;
+    }
+
+    void add_flip_workers() {
+        for (int i = flip_workers.size() + 1; i < flip_jobs; ++i) {
+            SMTSampler * w = new SMTSampler(*this, seed + 104729 * i);
+            w->prepare_flip_worker(*this);
+            flip_workers.push_back(w);
+        }
+    }
+
+    void sample_epochs() {
+        try {
+            add_flip_workers();
+            // The batch evaluator already checks the candidates of --sat,
+            // which only this sampler can convert.
+            if (!convert && check_jobs > 1) {
+                for (int i = 1; i < check_jobs; ++i) {
+                    SMTSampler * w = new SMTSampler(*this, seed + 15485863 * i);
+                    w->prepare_check_worker(*this);
+                    check_workers.push_back(w);
+                }
+                check_pool = new WorkerPool(check_jobs);
+            }
+            epoch_loop();
+        } catch (stop_sampling) {
+        } catch (sampler_error & e) {
+            fail(e);
+        } catch (z3::exception except) {
+            if (!store->stop)
+                log() << "Exception: " << except << "\n";
+        }
+        request_stop();
+        delete check_pool;
+        check_pool = NULL;
+    }
+
+    void epoch_loop() {
+        while (true) {
+            push();
+            std::vector<uint64_t> mask, fixed;
+            for (int count = 0; count < ind.size(); ++count) {
+                z3::func_decl & v = ind[count];
                 if (v.arity() > 0 || v.range().is_array())
                     continue;
+                // The random targets leave out the bits of the backbone.
+                bool has_fixed = backbone_bits(count, mask, fixed);
                 switch (v.range().sort_kind()) {
                 case Z3_BV_SORT:
                 {
 		    if (random_soft_bit) {
                         for (int i = 0; i < v.range().bv_size(); ++i) {
-                            if (rand() % 2)
+                            if (has_fixed && (mask[i / 64] >> (i % 64)) & 1)
+                                continue;
+                            if (next_rand() % 2)
                                 assert_soft(v().extract(i, i) == c.bv_val(0, 1));
                             else
                                 assert_soft(v().extract(i, i) != c.bv_val(0, 1));
@@ -104,68 +1003,485 @@ public:
                         char num[10];
                         int i = v.range().bv_size();
                         if (i % 4) {
-                            snprintf(num, 10, "%x", rand() & ((1<<(i%4)) - 1));
+                            snprintf(num, 10, "%x", next_rand() & ((1<<(i%4)) - 1));
                             n += num;
                             i -= (i % 4);
                         }
                         while (i) {
-                            snprintf(num, 10, "%x", rand() & 15);
+                            snprintf(num, 10, "%x", next_rand() & 15);
                             n += num;
                             i -= 4;
                         }
                         Z3_ast ast = parse_bv(n.c_str(), v.range(), c);
                         z3::expr exp(c, ast);
+                        if (has_fixed)
+                            exp = ((exp & ~value(mask.data(), v.range())) | value(fixed.data(), v.range())).simplify();
                         assert_soft(v() == exp);
 		    }
                     break;
                 }
                 case Z3_BOOL_SORT:
-                    if (rand() % 2)
+                    if (has_fixed)
+                        break;
+                    if (next_rand() % 2)
                         assert_soft(v());
                     else
                         assert_soft(!v());
                     break;
                 default:
-                    std::cout << "Invalid sort\n";
-                    exit(1);
+                    throw sampler_error{"Invalid sort", 1};
                 }
 
             }
             z3::check_result result = solve();
             if (result == z3::unsat) {
-                std::cout << "No solutions\n";
+                log() << "No solutions\n";
                 break;
             } else if (result == z3::unknown) {
-                std::cout << "Could not solve\n";
-                break;
+                // Another epoch draws other random targets.
+                log() << "Could not solve, skipping the epoch\n";
+                pop();
+                continue;
             }
 
-            opt.pop();
-            solver.pop();
+            pop();
 
             sample(model);
         }
     }
 
+    // Sets up a flip worker of owner: the same formula and independent
+    // variables, without the initial check.
+    void prepare_flip_worker(SMTSampler & owner) {
+        if (convert) {
+            z3::expr formula(c, Z3_translate(owner.c, owner.converted_goal->as_expr(), c));
+            for (z3::func_decl & v : owner.ind) {
+                Z3_ast ast = Z3_translate(owner.c, Z3_func_decl_to_ast(owner.c, v), c);
+                ind.push_back(z3::func_decl(c, Z3_to_func_decl(c, ast)));
+            }
+            opt.add(formula);
+            solver.add(formula);
+        } else {
+            opt.add(smt_formula);
+            solver.add(smt_formula);
+            visit(smt_formula);
+            ind = variables;
+        }
+        ind_layout.init(ind);
+    }
+
+    // Sets up a sampler that only checks candidates of owner: the variables
+    // and layout of owner, the native evaluator, and the nodes of the
+    // formula registered for coverage in the same order as in owner.
+    void prepare_check_worker(SMTSampler & owner) {
+        for (z3::func_decl & v : owner.variables) {
+            Z3_ast ast = Z3_translate(owner.c, Z3_func_decl_to_ast(owner.c, v), c);
+            variables.push_back(z3::func_decl(c, Z3_to_func_decl(c, ast)));
+        }
+        var_layout = owner.var_layout;
+        ind = variables;
+        ind_layout = owner.ind_layout;
+        evaluator.compile(smt_formula, variables);
+        Sample first = owner.model_sample(owner.model, owner.variables, owner.var_layout);
+        model = gen_model(first, variables, var_layout);
+        evaluate(model, smt_formula, true, 1);
+    }
+
+    // Finds the backbone of the formula: the bits of the constants of ind
+    // that no solution can flip. The bits are split among this sampler and
+    // its flip workers, which search their shares in parallel.
+    void find_backbone() {
+        double start = elapsed();
+        z3::check_result result = z3::unknown;
+        use_timeout(max_timeout);
+        try {
+            result = solver.check();
+        } catch (z3::exception except) {
+            log() << "Exception: " << except << "\n";
+        }
+        if (result != z3::sat) {
+            log() << "Backbone skipped, solver returned " << result << '\n';
+            return;
+        }
+        Sample m_sample = model_sample(solver.get_model(), ind, ind_layout);
+        std::vector<std::pair<int, int>> bits;
+        for (int i = 0; i < ind.size(); ++i) {
+            SampleLayout::Field const & f = ind_layout.fields[i];
+            if (f.is_table)
+                continue;
+            for (unsigned b = 0; b < f.width; ++b)
+                bits.emplace_back(i, b);
+        }
+
+        // The search gets a quarter of the time left; the bits found by
+        // then are fixed all the same.
+        double deadline = start + (max_time - start) / 4;
+        add_flip_workers();
+        int parts = flip_workers.size() + 1;
+        std::vector<std::vector<std::pair<int, int>>> fixed(parts);
+        std::vector<int> checks(parts);
+        auto work = [&](SMTSampler * s, int id) {
+            std::vector<std::pair<int, int>> share(bits.begin() + (long)id * bits.size() / parts, bits.begin() + (long)(id + 1) * bits.size() / parts);
+            try {
+                fixed[id] = s->fixed_bits(share, m_sample, checks[id], deadline);
+            } catch (stop_sampling) {
+            } catch (z3::exception except) {
+                if (!store->stop)
+                    log() << "Exception: " << except << "\n";
+            }
+        };
+        std::vector<std::thread> threads;
+        for (int i = 0; i < flip_workers.size(); ++i) {
+            threads.emplace_back(work, flip_workers[i], i + 1);
+        }
+        work(this, 0);
+        for (std::thread & t : threads) {
+            t.join();
+        }
+        if (store->stop) {
+            throw stop_sampling();
+        }
+        if (elapsed() >= deadline)
+            log() << "Backbone cut short at a quarter of the time\n";
+
+        backbone_mask.assign(ind_layout.words, 0);
+        backbone_value.assign(ind_layout.words, 0);
+        int count = 0;
+        int total_checks = 0;
+        for (int id = 0; id < parts; ++id) {
+            total_checks += checks[id];
+            for (std::pair<int, int> const & bit : fixed[id]) {
+                unsigned pos = ind_layout.fields[bit.first].offset + bit.second;
+                backbone_mask[pos / 64] |= 1ull << (pos % 64);
+                backbone_value[pos / 64] |= m_sample[pos / 64] & (1ull << (pos % 64));
+                ++count;
+            }
+        }
+        for (SMTSampler * w : flip_workers) {
+            w->backbone_mask = backbone_mask;
+            w->backbone_value = backbone_value;
+        }
+        stats.backbone = count;
+        log() << "Backbone " << count << " of " << bits.size() << " bits, " << total_checks << " checks, " << elapsed() - start << " s\n";
+    }
+
+    // Bits among the given (variable, bit) pairs of ind that keep their
+    // value in m_sample in every solution. Each check asks for a solution
+    // that flips one of a chunk of the last bits: a solution rules out every bit
+    // it flips, and no solution fixes the whole chunk, which then doubles.
+    // A chunk that times out is halved, and a single bit that times out is
+    // taken to be free. The bits left at the deadline are taken to be free
+    // too.
+    std::vector<std::pair<int, int>> fixed_bits(std::vector<std::pair<int, int>> bits, Sample const & m_sample, int & checks, double deadline) {
+        std::vector<std::pair<int, int>> fixed;
+        size_t chunk = 8;
+        use_timeout(max_timeout);
+        while (!bits.empty()) {
+            if (store->stop)
+                throw stop_sampling();
+            if (elapsed() >= deadline)
+                break;
+            size_t n = std::min(chunk, bits.size());
+            z3::expr_vector flips(c);
+            for (size_t k = bits.size() - n; k < bits.size(); ++k) {
+                z3::func_decl & v = ind[bits[k].first];
+                unsigned pos = ind_layout.fields[bits[k].first].offset + bits[k].second;
+                bool bit = (m_sample[pos / 64] >> (pos % 64)) & 1;
+                if (v.range().is_bool())
+                    flips.push_back(v() != c.bool_val(bit));
+                else
+                    flips.push_back(v().extract(bits[k].second, bits[k].second) != c.bv_val(bit, 1));
+            }
+            solver.push();
+            solver.add(z3::mk_or(flips));
+            z3::check_result result = solver.check();
+            ++checks;
+            if (result == z3::sat) {
+                Sample s = model_sample(solver.get_model(), ind, ind_layout);
+                bits.erase(std::remove_if(bits.begin(), bits.end(), [&](std::pair<int, int> const & b) {
+                    unsigned pos = ind_layout.fields[b.first].offset + b.second;
+                    return ((s[pos / 64] ^ m_sample[pos / 64]) >> (pos % 64)) & 1;
+                }), bits.end());
+            } else if (result == z3::unsat) {
+                fixed.insert(fixed.end(), bits.end() - n, bits.end());
+                bits.resize(bits.size() - n);
+                chunk = std::min<size_t>(2 * chunk, 1024);
+            } else if (n == 1) {
+                bits.pop_back();
+            } else {
+                chunk = n / 2;
+            }
+            solver.pop();
+        }
+        return fixed;
+    }
+
+    // Whether some bits of ind[count] are in the backbone, and if so which
+    // and their values.
+    bool backbone_bits(int count, std::vector<uint64_t> & mask, std::vector<uint64_t> & val) {
+        if (backbone_mask.empty())
+            return false;
+        SampleLayout::Field const & f = ind_layout.fields[count];
+        mask.resize(SampleLayout::nwords(f.width));
+        val.resize(mask.size());
+        ind_layout.get(backbone_mask, f, mask.data());
+        ind_layout.get(backbone_value, f, val.data());
+        for (uint64_t w : mask) {
+            if (w)
+                return true;
+        }
+        return false;
+    }
+
+    unsigned next_rand() {
+        return random.next() >> 32;
+    }
+
+    // Lets request_stop() interrupt the solver calls of this sampler.
+    // Workers are made by several threads at once, so this takes the lock.
+    void register_context() {
+        std::lock_guard<std::mutex> lock(store->mutex);
+        store->contexts.push_back(c);
+    }
+
+    // Stops every worker of the run, interrupting the solver calls they are
+    // blocked in.
+    void request_stop() {
+        store->stop = true;
+        std::lock_guard<std::mutex> lock(store->mutex);
+        for (Z3_context ctx : store->contexts) {
+            Z3_interrupt(ctx);
+        }
+    }
+
+    // Keeps the first error of the run and stops it.
+    void fail(sampler_error const & e) {
+        {
+            std::lock_guard<std::mutex> lock(store->mutex);
+            if (!store->failed) {
+                store->failed = true;
+                store->error = e;
+            }
+        }
+        request_stop();
+    }
+
+    // With the relax engine, a soft constraint is enabled by a fresh literal
+    // that solve() passes as an assumption.
     void assert_soft(z3::expr const & e) {
-        opt.add(e, 1);
+        if (engine == ENGINE_RELAX) {
+            z3::expr lit(c, Z3_mk_fresh_const(c, "soft", c.bool_sort()));
+            solver.add(z3::implies(lit, e));
+            soft_literals.push_back(lit);
+        } else {
+            opt.add(e, 1);
+        }
+    }
+
+    void push() {
+        opt.push();
+        solver.push();
+        soft_scopes.push_back(soft_literals.size());
+    }
+
+    void pop() {
+        opt.pop();
+        solver.pop();
+        soft_literals.erase(soft_literals.begin() + soft_scopes.back(), soft_literals.end());
+        soft_scopes.pop_back();
+    }
+
+    double elapsed() {
+        return monotonic_now() - start_time;
+    }
+
+    // Copies the stats of this job where the master, or Sampler::stats()
+    // while sampling, can read them: after the flips and each level of
+    // combinations of an epoch. The master keeps its own unsat flips
+    // and coverage for checkpoints.
+    void publish() {
+        bool checkpoint = checkpoint_interval > 0 && job > 0;
+        std::vector<uint64_t> coverage;
+        if (checkpoint)
+            coverage_save(c, coverage);
+        std::lock_guard<std::mutex> lock(store->mutex);
+        if (job >= store->published.size())
+            return;
+        store->published[job] = stats;
+        if (checkpoint) {
+            store->published_unsat[job] = unsat_ind;
+            store->published_coverage[job].swap(coverage);
+        }
+    }
+
+    std::vector<std::string> variable_names() {
+        std::vector<std::string> names;
+        for (z3::func_decl & v : variables)
+            names.push_back(v.name().str());
+        return names;
+    }
+
+    std::string checkpoint_name() {
+        return input_file + ".checkpoint";
+    }
+
+    // Restores the state of the run saved in the checkpoint, if there is
+    // one, and continues its samples file.
+    bool resume_run() {
+        Checkpoint ck;
+        FILE * f = fopen(checkpoint_name().c_str(), "rb");
+        if (!f) {
+            log() << "No checkpoint, starting over\n";
+            return false;
+        }
+        fclose(f);
+        // The header is checked even if the rest cannot be read, as with
+        // samples saved without --exact-dedupe and read with it.
+        bool loaded = ck.load(checkpoint_name(), store->all_mutations);
+        if (ck.formula != 0 && (ck.formula != formula_hash || ck.strategy != strategy || ck.binary != binary || ck.exact_dedupe != exact_dedupe)) {
+            throw sampler_error{"Checkpoint is for another formula or other options", 1};
+        }
+        if (!loaded) {
+            throw sampler_error{"Could not read checkpoint " + checkpoint_name(), 1};
+        }
+        bool ok = binary
+            ? store->writer.resume_binary(input_file + ".samples.bin", var_layout, variable_names(), ck.position[0], ck.position[1])
+            : store->writer.resume(input_file + ".samples", var_layout, ck.position[0], ck.position[1]);
+        if (!ok) {
+            throw sampler_error{"Could not resume the samples file", 1};
+        }
+        store->samples = ck.samples;
+        store->valid_samples = ck.valid_samples;
+        stats.epochs = ck.epochs;
+        stats.flips = ck.flips;
+        stats.solver_calls = ck.solver_calls;
+        stats.unsat_ind = ck.unsat_ind;
+        for (std::pair<int, int> const & p : ck.unsat)
+            unsat_ind[p.first].insert(p.second);
+        for (std::vector<uint64_t> const & words : ck.coverage)
+            coverage_load(c, words);
+        // The same seed would replay the epochs of the earlier run, whose
+        // samples are all known, so it moves on with the work done. The
+        // workers, made later, take their seeds from this one.
+        seed += ck.solver_calls * 0x9e3779b97f4a7c15ull + ck.epochs;
+        random.seed(seed);
+        log() << "Resumed " << store->all_mutations.size() << " unique samples, seed " << seed << '\n';
+        return true;
+    }
+
+    // Saves the state of the run. Until the end of the run, the other jobs
+    // are saved as of their last epoch; the set of unique samples and the
+    // samples file are always saved as they are now.
+    void save_checkpoint(bool final) {
+        Checkpoint ck;
+        ck.formula = formula_hash;
+        ck.strategy = strategy;
+        ck.binary = binary;
+        ck.exact_dedupe = exact_dedupe;
+        SamplerStats total = stats;
+        std::vector<std::unordered_map<int, std::unordered_set<int>> const *> unsat;
+        unsat.push_back(&unsat_ind);
+        ck.coverage.emplace_back();
+        coverage_save(c, ck.coverage.back());
+        std::lock_guard<std::mutex> lock(store->mutex);
+        if (final) {
+            for (SMTSampler * w : workers)
+                unsat.push_back(&w->unsat_ind);
+        } else {
+            for (int i = 1; i < store->published.size(); ++i) {
+                total.merge(store->published[i]);
+                unsat.push_back(&store->published_unsat[i]);
+                if (!store->published_coverage[i].empty())
+                    ck.coverage.push_back(store->published_coverage[i]);
+            }
+        }
+        std::set<std::pair<int, int>> pairs;
+        for (auto const * u : unsat) {
+            for (auto const & entry : *u) {
+                for (int bit : entry.second)
+                    pairs.insert(std::make_pair(entry.first, bit));
+            }
+        }
+        ck.unsat.assign(pairs.begin(), pairs.end());
+        ck.epochs = total.epochs;
+        ck.flips = total.flips;
+        ck.solver_calls = total.solver_calls;
+        ck.unsat_ind = total.unsat_ind;
+        store->writer.sync(ck.position);
+        ck.samples = store->samples;
+        ck.valid_samples = store->valid_samples;
+        if (!ck.save(checkpoint_name(), store->all_mutations))
+            log() << "Could not write checkpoint " << checkpoint_name() << '\n';
+        last_checkpoint = elapsed();
+    }
+
+    void maybe_checkpoint() {
+        if (job == 0 && checkpoint_interval > 0 && elapsed() - last_checkpoint >= checkpoint_interval)
+            save_checkpoint(false);
+    }
+
+    // Writes the stats of all jobs as of their last publish(), at most once
+    // a second until the final stats.
+    void write_stats_json(SamplerStats const & total, bool final) {
+        double now = elapsed();
+        if (!final && now - last_json < 1.0)
+            return;
+        last_json = now;
+        unsigned counts[4];
+        coverage_counts(c, counts);
+        std::string tmp = stats_json + ".tmp";
+        std::ofstream out(tmp);
+        out << "{\"final\": " << (final ? "true" : "false") << ", \"seed\": " << seed << ", \"elapsed\": " << now
+            << ", \"samples\": " << store->samples << ", \"valid_samples\": " << store->valid_samples;
+        {
+            std::lock_guard<std::mutex> lock(store->mutex);
+            out << ", \"unique_samples\": " << store->all_mutations.size();
+        }
+        out << ", \"solver_timeout_ms\": " << timeout
+            << ", \"coverage\": {\"bool\": [" << counts[0] - counts[1] << ", " << counts[1]
+            << "], \"bv\": [" << counts[2] - counts[3] << ", " << counts[3] << "]}, ";
+        total.json(out);
+        out << "}\n";
+        out.close();
+        rename(tmp.c_str(), stats_json.c_str());
     }
 
     void print_stats() {
-        struct timespec end;
-        clock_gettime(CLOCK_REALTIME, &end);
-        double elapsed = duration(&start_time, &end);
-        std::cout << "Samples " << samples << '\n';
-        std::cout << "Valid samples " << valid_samples << '\n';
-        std::cout << "Unique valid samples " << all_mutations.size() << '\n';
-        std::cout << "Total time " << elapsed << '\n';
-        std::cout << "Solver time: " << solver_time << '\n';
-        std::cout << "Convert time: " << convert_time << '\n';
-
-        std::cout << "Check time " << check_time << '\n';
-        std::cout << "Coverage time: " << cov_time << '\n';
-        std::cout << "Coverage bool: " << coverage_bool - coverage_all_bool << '/' << coverage_all_bool << ", coverage bv " << coverage_bv - coverage_all_bv << '/' << coverage_all_bv << '\n';
-        std::cout << "Epochs " << epochs << ", Flips " << flips << ", UnsatInd " << unsat_ind_count << '/' << all_ind_count << ", UnsatInternal " << unsat_internal.size() << ", Calls " << solver_calls << '\n' << std::flush;
+        double elapsed = this->elapsed();
+        log() << "Samples " << store->samples << '\n';
+        log() << "Valid samples " << store->valid_samples << '\n';
+        {
+            std::lock_guard<std::mutex> lock(store->mutex);
+            log() << "Unique valid samples " << store->all_mutations.size() << '\n';
+            log() << "Dedupe memory " << store->all_mutations.memory() / 1048576.0 << " MB, saved "
+                      << ((double)store->all_mutations.node_memory() - store->all_mutations.memory()) / 1048576.0 << " MB\n";
+        }
+        log() << "Total time " << elapsed << '\n';
+        log() << "Solver time: " << stats.solve.wall << '\n';
+        log() << "Solver timeout " << timeout << " ms, timed out " << stats.timeouts << '\n';
+        log() << "Convert time: " << stats.convert.wall << '\n';
+
+        log() << "Check time " << stats.check.wall << '\n';
+        log() << "Coverage time: " << stats.coverage.wall << '\n';
+        unsigned counts[4];
+        coverage_counts(c, counts);
+        log() << "Coverage bool: " << counts[0] - counts[1] << '/' << counts[1] << ", coverage bv " << counts[2] - counts[3] << '/' << counts[3] << '\n';
+        log() << "Epochs " << stats.epochs << ", Flips " << stats.flips << ", UnsatInd " << stats.unsat_ind << '/' << all_ind_count << ", UnsatInternal " << unsat_internal.size() << ", Calls " << stats.solver_calls << ", Relaxations " << stats.relaxations << '\n' << std::flush;
+        maybe_write_stats();
+    }
+
+    // Called by the master during the flips and combinations, so that the
+    // stats JSON follows a long epoch.
+    void maybe_write_stats() {
+        if (job != 0 || stats_json.empty() || store->stop || elapsed() - last_json < 1.0)
+            return;
+        SamplerStats total = stats;
+        {
+            std::lock_guard<std::mutex> lock(store->mutex);
+            for (int i = 1; i < store->published.size(); ++i)
+                total.merge(store->published[i]);
+        }
+        write_stats_json(total, false);
     }
 
     std::unordered_set<Z3_ast> sub;
@@ -198,8 +1514,7 @@ public:
                         ++num_bits;
                         break;
                     default:
-                        std::cout << "Invalid sort\n";
-                        exit(1);
+                        throw sampler_error{"Invalid sort", 1};
                     }
                 }
             }
@@ -222,14 +1537,187 @@ public:
             visit(e.arg(i), depth + 1);
     }
 
+    // The conjuncts of the formula, with nested conjunctions flattened.
+    std::vector<z3::expr> top_conjuncts() {
+        std::vector<z3::expr> conjuncts;
+        std::vector<z3::expr> todo = { smt_formula };
+        while (!todo.empty()) {
+            z3::expr e = todo.back();
+            todo.pop_back();
+            if (e.is_app() && e.decl().decl_kind() == Z3_OP_AND) {
+                for (int i = e.num_args() - 1; i >= 0; --i)
+                    todo.push_back(e.arg(i));
+            } else {
+                conjuncts.push_back(e);
+            }
+        }
+        return conjuncts;
+    }
+
+    // Splits the conjuncts into components that share no variables, as
+    // lists of their indices. Every node is walked once: a node reached
+    // again from another conjunct joins the two components, unless it is a
+    // leaf other than a variable, such as a numeral, and so does an
+    // uninterpreted function applied in both.
+    std::vector<std::vector<int>> find_components(std::vector<z3::expr> const & conjuncts) {
+        std::vector<int> parent(conjuncts.size());
+        for (int k = 0; k < parent.size(); ++k)
+            parent[k] = k;
+        auto root = [&](int k) {
+            while (parent[k] != k)
+                k = parent[k] = parent[parent[k]];
+            return k;
+        };
+        std::unordered_map<Z3_ast, int> owner;
+        std::unordered_map<Z3_func_decl, int> function_owner;
+        for (int k = 0; k < conjuncts.size(); ++k) {
+            std::vector<z3::expr> stack = { conjuncts[k] };
+            while (!stack.empty()) {
+                z3::expr e = stack.back();
+                stack.pop_back();
+                auto it = owner.find(e);
+                if (it != owner.end()) {
+                    bool leaf = !e.is_app() || (e.num_args() == 0 && e.decl().decl_kind() != Z3_OP_UNINTERPRETED);
+                    if (!leaf)
+                        parent[root(it->second)] = root(k);
+                    continue;
+                }
+                owner[e] = k;
+                if (e.is_quantifier()) {
+                    stack.push_back(e.body());
+                } else if (e.is_app()) {
+                    if (e.num_args() > 0 && e.decl().decl_kind() == Z3_OP_UNINTERPRETED) {
+                        auto f = function_owner.emplace(e.decl(), k).first;
+                        parent[root(f->second)] = root(k);
+                    }
+                    for (int i = 0; i < e.num_args(); ++i)
+                        stack.push_back(e.arg(i));
+                }
+            }
+        }
+        std::vector<std::vector<int>> components;
+        std::unordered_map<int, int> index;
+        for (int k = 0; k < conjuncts.size(); ++k) {
+            auto it = index.emplace(root(k), components.size()).first;
+            if (it->second == components.size())
+                components.emplace_back();
+            components[it->second].push_back(k);
+        }
+        return components;
+    }
+
+    // Finds the conjuncts of the formula that every variable occurs in. The
+    // nodes shared by several conjuncts are walked once for each, so the
+    // walk gives up after visiting 16 times as many nodes as the formula
+    // has; it also gives up on quantifiers, whose bodies it does not follow.
+    void find_cones(uint64_t nodes) {
+        std::vector<z3::expr> conjuncts = top_conjuncts();
+        unsigned classes = std::min<size_t>(conjuncts.size(), 4096);
+        std::unordered_map<Z3_func_decl, int> index;
+        for (int i = 0; i < variables.size(); ++i)
+            index[variables[i]] = i;
+        var_cones.assign(variables.size(), std::vector<uint64_t>(SampleLayout::nwords(classes)));
+        std::unordered_map<Z3_ast, unsigned> stamp;
+        uint64_t visits = 0;
+        for (unsigned k = 0; k < conjuncts.size(); ++k) {
+            unsigned cls = k % classes;
+            std::vector<z3::expr> stack = { conjuncts[k] };
+            while (!stack.empty()) {
+                z3::expr e = stack.back();
+                stack.pop_back();
+                unsigned & seen = stamp[e];
+                if (seen == k + 1)
+                    continue;
+                seen = k + 1;
+                if (++visits > 16 * nodes + 1024 || !e.is_app()) {
+                    var_cones.clear();
+                    if (!quiet)
+                        log() << "Cones of influence disabled\n";
+                    return;
+                }
+                auto v = index.find(e.decl());
+                if (v != index.end())
+                    var_cones[v->second][cls / 64] |= 1ull << (cls % 64);
+                for (int i = 0; i < e.num_args(); ++i)
+                    stack.push_back(e.arg(i));
+            }
+        }
+    }
+
+    // Conjuncts that the variables changed from m_sample in s occur in.
+    std::vector<uint64_t> cone(Sample const & m_sample, Sample const & s) {
+        std::vector<uint64_t> result(var_cones[0].size());
+        for (unsigned i : ind_layout.changed(m_sample, s)) {
+            for (size_t w = 0; w < result.size(); ++w)
+                result[w] |= var_cones[i][w];
+        }
+        return result;
+    }
+
     void parse_smt() {
-        z3::expr formula = c.parse_file(input_file.c_str());
+        z3::expr formula(c);
+        try {
+            formula = c.parse_file(input_file.c_str());
+        } catch (z3::exception except) {
+            throw sampler_error{"Could not read input formula: " + std::string(except.msg()), 1};
+        }
         Z3_ast ast = formula;
         if (ast == NULL) {
-            std::cout << "Could not read input formula.\n";
-            exit(1);
+            throw sampler_error{"Could not read input formula.", 1};
         }
         smt_formula = formula;
+        prepare();
+    }
+
+    // With --sat, neither the first solution nor the cones are saved, so
+    // those runs keep a cache of their own.
+    std::string cache_name() {
+        char hex[17];
+        snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)formula_hash);
+        return cache_dir + "/" + hex + (convert ? ".sat" : "") + ".cache";
+    }
+
+    void load_cache() {
+        FormulaCache * loaded = new FormulaCache();
+        if (loaded->load(cache_name(), formula_hash)) {
+            cache = loaded;
+            own_cache = true;
+            log() << "Using cached formula " << cache_name() << '\n';
+        } else {
+            delete loaded;
+        }
+    }
+
+    // Keeps what prepare() found for the workers, and saves it to the cache
+    // directory when there is one.
+    void save_cache(std::vector<uint64_t> const & counts) {
+        FormulaCache * found = new FormulaCache();
+        found->hash = formula_hash;
+        found->counts = counts;
+        found->names = variable_names();
+        found->fields = var_layout.fields;
+        if (!convert) {
+            found->model = model_sample(model, variables, var_layout);
+            found->cones = var_cones;
+        }
+        cache = found;
+        own_cache = true;
+        if (cache_dir.empty())
+            return;
+        mkdir(cache_dir.c_str(), 0777);
+        if (!found->save(cache_name()))
+            log() << "Could not write " << cache_name() << '\n';
+    }
+
+    // Sets up the solvers and the variables. With a cache, the variables and
+    // their cones are rebuilt from it instead of walking the formula, and the
+    // cached first solution replaces the first check.
+    void prepare() {
+        z3::expr formula = smt_formula;
+        if (cache) {
+            variables = cache->decls(c);
+            var_layout.init(variables);
+        }
         if (convert) {
             z3::tactic simplify(c, "simplify");
             z3::tactic bvarray2uf(c, "bvarray2uf");
@@ -239,12 +1727,13 @@ public:
             z3::goal g(c);
             g.add(formula);
 
-            struct timespec start;
-            clock_gettime(CLOCK_REALTIME, &start);
-	    z3::apply_result res = t(g);
-            struct timespec end;
-            clock_gettime(CLOCK_REALTIME, &end);
-            convert_time += duration(&start, &end);
+            // Only the time of the model conversions goes to the latency
+            // of the convert phase.
+            double wall = monotonic_now();
+            double cpu = thread_cpu_now();
+            res0 = new z3::apply_result(t(g));
+            stats.convert.wall += monotonic_now() - wall;
+            stats.convert.cpu += thread_cpu_now() - cpu;
 
             assert(res0->size() == 1);
             converted_goal = new z3::goal((*res0)[0]);
@@ -257,56 +1746,84 @@ public:
             try {
                 result = s.check();
             } catch (z3::exception except) {
-                std::cout << "Exception: " << except << "\n";
+                log() << "Exception: " << except << "\n";
             }
-            if (result == z3::unsat) {
-                std::cout << "Formula is unsat\n";
-                exit(0);
+            if (store->stop) {
+                throw stop_sampling();
+            } else if (result == z3::unsat) {
+                throw sampler_error{"Formula is unsat", 0};
             } else if (result == z3::unknown) {
-                std::cout << "Solver returned unknown\n";
-                exit(0);
+                throw sampler_error{"Solver returned unknown", 0};
             }
             z3::model m = s.get_model();
             ind = get_variables(m, true);
+            if (!batch.compile(formula, ind) && !quiet) {
+                log() << "Batch evaluator disabled, unsupported " << batch.unsupported << '\n';
+            }
             z3::model original = res0->convert_model(m);
             evaluate(original, smt_formula, true, 1);
 
             opt.add(formula);
             solver.add(formula);
+        } else if (cache && !cache->model.empty()) {
+            opt.add(formula);
+            solver.add(formula);
+            model = gen_model(cache->model, variables, var_layout);
+            evaluate(model, smt_formula, true, 1);
         } else {
             opt.add(formula);
             solver.add(formula);
             z3::check_result result = solve();
             if (result == z3::unsat) {
-                std::cout << "Formula is unsat\n";
-                exit(0);
+                throw sampler_error{"Formula is unsat", 0};
             } else if (result == z3::unknown) {
-                std::cout << "Solver could not solve\n";
-                exit(0);
+                throw sampler_error{"Solver could not solve", 0};
             }
             evaluate(model, smt_formula, true, 1);
         }
 
-        visit(smt_formula);
-        std::cout << "Nodes " << sup.size() << '\n';
-        std::cout << "Internal nodes " << sub.size() << '\n';
-        std::cout << "Arrays " << num_arrays << '\n';
-        std::cout << "Bit-vectors " << num_bv << '\n';
-        std::cout << "Bools " << num_bools << '\n';
-        std::cout << "Bits " << num_bits << '\n';
-        std::cout << "Uninterpreted functions " << num_uf << '\n';
+        std::vector<uint64_t> counts;
+        if (cache) {
+            counts = cache->counts;
+        } else {
+            visit(smt_formula);
+            counts = { sup.size(), sub.size(), (uint64_t)num_arrays, (uint64_t)num_bv, (uint64_t)num_bools, (uint64_t)num_bits, (uint64_t)num_uf };
+        }
+        if (!quiet) {
+            log() << "Nodes " << counts[0] << '\n';
+            log() << "Internal nodes " << counts[1] << '\n';
+            log() << "Arrays " << counts[2] << '\n';
+            log() << "Bit-vectors " << counts[3] << '\n';
+            log() << "Bools " << counts[4] << '\n';
+            log() << "Bits " << counts[5] << '\n';
+            log() << "Uninterpreted functions " << counts[6] << '\n';
+        }
+        if (!evaluator.compile(smt_formula, variables) && !quiet) {
+            log() << "Native evaluator disabled, unsupported " << evaluator.unsupported << '\n';
+        }
         if (!convert) {
             ind = variables;
+            if (!cache) {
+                find_cones(counts[0]);
+            } else {
+                var_cones = cache->cones;
+                if (var_cones.empty() && !quiet)
+                    log() << "Cones of influence disabled\n";
+            }
         }
+        var_layout.init(variables);
+        ind_layout.init(ind);
         for (Z3_ast e : sub) {
             internal.push_back(z3::expr(c, e));
         }
+        if (!cache)
+            save_cache(counts);
     }
 
     z3::expr evaluate(z3::model m, z3::expr e, bool b, int n) {
-        coverage_enable = n;
+        coverage_set_mode(c, n);
         z3::expr res = m.eval(e, b);
-        coverage_enable = 0;
+        coverage_set_mode(c, 0);
         return res;
     }
 
@@ -319,11 +1836,13 @@ public:
         for (int i = 0; i < m.size(); ++i) {
             z3::func_decl fd = m[i];
             if (!is_ind && (fd.name().kind() == Z3_INT_SYMBOL || fd.name().str().find("k!") == 0)) {
-                std::cout << fd << ": ignoring\n";
+                if (!quiet)
+                    log() << fd << ": ignoring\n";
                 continue;
             }
             ind.push_back(fd);
-            std::cout << str << fd << '\n';
+            if (!quiet)
+                log() << str << fd << '\n';
         }
         return ind;
     }
@@ -364,36 +1883,159 @@ public:
         solver.add(formula);
     }
 
-    z3::expr value(char const * n, z3::sort s) {
+    z3::expr value(uint64_t const * v, z3::sort s) {
         switch (s.sort_kind()) {
         case Z3_BV_SORT:
         {
-            Z3_ast ast = parse_bv(n, s, c);
+            if (s.bv_size() <= 64)
+                return c.bv_val((uint64_t)v[0], s.bv_size());
+            std::string n;
+            SampleLayout::render_value(n, v, false, s.bv_size());
+            Z3_ast ast = parse_bv(n.c_str(), s, c);
             z3::expr exp(c, ast);
             return exp;
         }
         case Z3_BOOL_SORT:
-            return c.bool_val(atoi(n) == 1);
+            return c.bool_val(v[0] != 0);
         default:
-            std::cout << "Invalid sort\n";
-            exit(1);
+            throw sampler_error{"Invalid sort", 1};
         }
     }
 
     void sample(z3::model m) {
-        std::unordered_set<std::string> mutations;
-        std::string m_string = model_string(m, ind);
+        SampleSet mutations(exact_dedupe);
+        std::vector<Sample> initial;
+        std::vector<int> flipped;
+        Sample m_sample = model_sample(m, ind, ind_layout);
         output(m, 0);
-        opt.push();
-        solver.push();
-        size_t pos = 0;
+        push();
+        build_constraints(m_sample);
+
+        double start_epoch = elapsed();
+
+        if (!quiet)
+            print_stats();
+        if (flip_workers.empty())
+            serial_flip(mutations, initial, flipped, start_epoch);
+        else
+            parallel_flip(m_sample, mutations, initial, flipped, start_epoch);
+        publish();
+
+        std::vector<std::vector<uint64_t>> cones;
+        if (!var_cones.empty()) {
+            for (Sample const & s : initial)
+                cones.push_back(cone(m_sample, s));
+        }
+        std::vector<Combination> sigma;
+        for (int i = 0; i < initial.size(); ++i)
+            sigma.push_back(Combination{initial[i], {i}, flip_score(flipped[i]), cones.empty() ? std::vector<uint64_t>() : cones[i], false});
+        long budget = combine_budget > 0 ? combine_budget : LONG_MAX;
+        // Valid samples per second of the flips, which a new epoch would
+        // give for the time spent on combinations. A budget of candidates
+        // replaces it, so that what is combined does not depend on timing.
+        double flip_rate = combine_budget > 0 ? 0.0 : initial.size() / std::max(elapsed() - start_epoch, 1.0e-3);
+
+        for (int k = 2; k <= 6 && budget > 0; ++k) {
+                if (!quiet)
+                    log() << "Combining " << k << " mutations\n";
+                std::vector<double> scores;
+                for (int f : flipped)
+                    scores.push_back(flip_score(f));
+                CombinationQueue queue(sigma, scores, cones);
+                std::vector<Combination> new_sigma;
+                std::vector<Combination> pending;
+                int all = 0;
+                int good = 0;
+                int window_all = 0;
+                int window_good = 0;
+                double window_start = elapsed();
+                int b, f;
+                bool disjoint;
+
+                while (budget > 0 && queue.pop(b, f, disjoint)) {
+                    Combination const & base = sigma[b];
+                    if (std::find(base.parts.begin(), base.parts.end(), f) != base.parts.end())
+                        continue;
+                    Sample candidate = ind_layout.combine(m_sample, base.sample, initial[f]);
+                    if (!mutations.insert(candidate))
+                        continue;
+                    --budget;
+                    Combination next{candidate, base.parts, base.score * (disjoint ? 1.0 : scores[f]), base.cone, disjoint};
+                    next.parts.push_back(f);
+                    for (size_t w = 0; w < next.cone.size(); ++w)
+                        next.cone[w] |= cones[f][w];
+                    if (batch.ok()) {
+                        batch.add(candidate);
+                        pending.push_back(next);
+                        if (batch.full())
+                            flush_batch(pending, k, flipped, all, good, new_sigma);
+                    } else if (check_pool) {
+                        // Batches of a window, so that the window is judged
+                        // after the same candidates for any number of
+                        // checkers.
+                        pending.push_back(next);
+                        if (pending.size() >= 64)
+                            check_batch(pending, k, flipped, all, good, new_sigma);
+                    } else {
+                        bool valid;
+                        if (convert) {
+                            z3::model cand = gen_model(candidate, ind, ind_layout);
+                            valid = output(cand, k);
+                        } else {
+                            valid = output(candidate, k);
+                        }
+                        judge(next, valid, flipped, all, good, new_sigma);
+                    }
+                    // The pairs come in order of their chances, so once a
+                    // window of them yields less than the least accuracy of
+                    // a level, or valid samples slower than the flips, the
+                    // rest of the level would too.
+                    if (all - window_all >= 64) {
+                        maybe_write_stats();
+                        double now = elapsed();
+                        int window = good - window_good;
+                        if (window < 0.1 * (all - window_all) || window < flip_rate * (now - window_start))
+                            break;
+                        window_all = all;
+                        window_good = good;
+                        window_start = now;
+                    }
+                }
+                if (batch.ok())
+                    flush_batch(pending, k, flipped, all, good, new_sigma);
+                if (check_pool) {
+                    check_batch(pending, k, flipped, all, good, new_sigma);
+                    merge_check_workers();
+                }
+                stats.combined[k] += all;
+                stats.combined_valid[k] += good;
+                publish();
+                maybe_checkpoint();
+                double accuracy = (double)good / (double)all;
+                if (!quiet) {
+                    log() << "Valid: " << good << " / " << all << " = " << accuracy << '\n';
+                    print_stats();
+                }
+                if (all == 0 || accuracy < 0.1)
+                    break;
+                sigma.swap(new_sigma);
+        }
+
+        stats.epochs += 1;
+        pop();
+        publish();
+        maybe_checkpoint();
+    }
 
+    void build_constraints(Sample const & m_sample) {
         constraints.clear();
         soft_constraints.clear();
         cons_to_ind.clear();
+        soft_owner.clear();
         all_ind_count = 0;
 
         if (flip_internal) {
+            z3::model m = gen_model(m_sample, ind, ind_layout);
             for (z3::expr & v : internal) {
                 z3::expr b = m.eval(v, true);
                 cons_to_ind.emplace_back(-1, -1);
@@ -403,191 +2045,421 @@ public:
             }
         }
 
+        std::vector<uint64_t> a, mask, fixed;
+        size_t pos = ind_layout.words;
         for (int count = 0; count < ind.size(); ++count) {
             z3::func_decl & v = ind[count];
-            if (v.range().is_array()) {
-                assert(m_string.c_str()[pos] == '[');
-                ++pos;
-                int num = atoi(m_string.c_str() + pos);
-                pos = m_string.find('\0', pos) + 1;
-
-                z3::expr def = value(m_string.c_str() + pos, v.range().array_range());
-                pos = m_string.find('\0', pos) + 1;
-
-                for (int j = 0; j < num; ++j) {
-                    z3::expr arg = value(m_string.c_str() + pos, v.range().array_domain());
-                    pos = m_string.find('\0', pos) + 1;
-                    z3::expr val = value(m_string.c_str() + pos, v.range().array_range());
-                    pos = m_string.find('\0', pos) + 1;
-
-                    add_constraints(z3::select(v(), arg), val, -1);
+            SampleLayout::Field const & f = ind_layout.fields[count];
+            if (!f.is_table) {
+                a.resize(SampleLayout::nwords(f.width));
+                ind_layout.get(m_sample, f, a.data());
+                if (backbone_bits(count, mask, fixed))
+                    add_constraints(v(), value(a.data(), v.range()), count, mask.data());
+                else
+                    add_constraints(v(), value(a.data(), v.range()), count);
+                continue;
+            }
+            uint64_t num = m_sample[pos];
+            size_t e = pos + 1 + f.val_words;
+            for (uint64_t j = 0; j < num; ++j) {
+                z3::expr_vector args(c);
+                for (int k = 0; k < f.arg_width.size(); ++k) {
+                    z3::sort s = f.is_array ? v.range().array_domain() : v.domain(k);
+                    args.push_back(value(&m_sample[e], s));
+                    e += SampleLayout::nwords(f.arg_width[k]);
                 }
-                assert(m_string.c_str()[pos] == ']');
-                ++pos;
-            } else if (v.is_const()) {
-                z3::expr a = value(m_string.c_str() + pos, v.range());
-                pos = m_string.find('\0', pos) + 1;
-                add_constraints(v(), a, count);
-            } else {
-                assert(m_string.c_str()[pos] == '(');
-                ++pos;
-                int num = atoi(m_string.c_str() + pos);
-                pos = m_string.find('\0', pos) + 1;
-
-                z3::expr def = value(m_string.c_str() + pos, v.range());
-                pos = m_string.find('\0', pos) + 1;
-
-                for (int j = 0; j < num; ++j) {
-                    z3::expr_vector args(c);
-                    for (int k = 0; k < v.arity(); ++k) {
-                        z3::expr arg = value(m_string.c_str() + pos, v.domain(k));
-                        pos = m_string.find('\0', pos) + 1;
-                        args.push_back(arg);
-                    }
-                    z3::expr val = value(m_string.c_str() + pos, v.range());
-                    pos = m_string.find('\0', pos) + 1;
-
+                z3::sort s = f.is_array ? v.range().array_range() : v.range();
+                z3::expr val = value(&m_sample[e], s);
+                e += f.val_words;
+                if (f.is_array)
+                    add_constraints(z3::select(v(), args[0]), val, -1);
+                else
                     add_constraints(v(args), val, -1);
-                }
-                assert(m_string.c_str()[pos] == ')');
-                ++pos;
             }
+            pos += SampleLayout::table_size(f, num);
         }
 
-        struct timespec etime;
-        clock_gettime(CLOCK_REALTIME, &etime);
-        double start_epoch = duration(&start_time, &etime);
+        // Every flip gets a literal that enables its negated constraint, so
+        // flips are checks under one assumption on the same solver state.
+        flip_literals.clear();
+        if (use_assumptions) {
+            for (z3::expr & cond : constraints) {
+                z3::expr lit(c, Z3_mk_fresh_const(c, "flip", c.bool_sort()));
+                opt.add(z3::implies(lit, !cond));
+                solver.add(z3::implies(lit, !cond));
+                flip_literals.push_back(lit);
+            }
+        }
+    }
 
-        print_stats();
+    bool known_unsat(int count) {
+        auto u = unsat_ind.find(cons_to_ind[count].first);
+        return u != unsat_ind.end() && u->second.find(cons_to_ind[count].second) != u->second.end();
+    }
+
+    void record_unsat(int count) {
+        if (!is_ind(count)) {
+            unsat_internal.insert(count);
+        } else if (cons_to_ind[count].first >= 0) {
+            unsat_ind[cons_to_ind[count].first].insert(cons_to_ind[count].second);
+            ++stats.unsat_ind;
+        }
+    }
+
+    // Decides whether to spend a solver call on the next flip, given the
+    // number of flips left and the calls made so far in the epoch.
+    bool should_flip(int remaining, int calls, double start_epoch) {
+        double elapsed = this->elapsed();
+
+        double cost = calls ? (elapsed - start_epoch) / calls : 0.0;
+        cost *= remaining;
+        if (max_time/3.0 + start_epoch > max_time && elapsed + cost > max_time) {
+            log() << "Stopping: slow\n";
+            finish();
+        }
+        return cost * random.uniform() <= max_time/3.0 + start_epoch - elapsed;
+    }
+
+    // Looks for a solution that violates constraints[count], leaving it in
+    // model when there is one.
+    z3::check_result flip(int count) {
+        if (use_assumptions && soft_constraints[count].empty()) {
+            z3::expr_vector assumptions(c);
+            assumptions.push_back(flip_literals[count]);
+            return solve(assumptions, true);
+        }
+        z3::expr & cond = constraints[count];
+        push();
+        opt.add(!cond);
+        solver.add(!cond);
+        for (z3::expr & soft : soft_constraints[count]) {
+            assert_soft(soft);
+        }
+        z3::check_result result = solve(true);
+        pop();
+        return result;
+    }
+
+    // Later flips that seem pinned to the failed flip of constraints[count]:
+    // those whose soft constraints the relax engine dropped for it, and the
+    // later bits of the same variable.
+    std::vector<int> pinned(int count) {
+        std::vector<int> result;
+        std::unordered_set<int> seen;
+        for (z3::expr & lit : relaxed) {
+            auto o = soft_owner.find(lit);
+            if (o != soft_owner.end() && o->second > count && seen.insert(o->second).second)
+                result.push_back(o->second);
+        }
+        int var = cons_to_ind[count].first;
+        for (int j = count + 1; var >= 0 && j < cons_to_ind.size() && cons_to_ind[j].first == var; ++j) {
+            if (seen.insert(j).second)
+                result.push_back(j);
+        }
+        return result;
+    }
+
+    // Settles the given flips in a few checks instead of one each. Every
+    // check asks for a solution that makes any of the flips left: without
+    // one, they are all unsat and returned; a solution is added to more,
+    // with the first flip it makes, and rules out the flips it makes.
+    std::vector<int> generalise(std::vector<int> candidates, std::vector<std::pair<int, Sample>> & more, int & calls) {
+        for (int round = 0; round < 8 && !candidates.empty(); ++round) {
+            z3::expr_vector any(c);
+            for (int j : candidates)
+                any.push_back(!constraints[j]);
+            push();
+            opt.add(z3::mk_or(any));
+            solver.add(z3::mk_or(any));
+            z3::check_result result = solve(true);
+            pop();
+            ++calls;
+            if (result == z3::unsat)
+                return candidates;
+            if (result != z3::sat)
+                break;
+            std::vector<int> made;
+            std::vector<int> left;
+            for (int j : candidates) {
+                if (model.eval(constraints[j], true).is_false())
+                    made.push_back(j);
+                else
+                    left.push_back(j);
+            }
+            if (made.empty())
+                break;
+            more.emplace_back(made[0], model_sample(model, ind, ind_layout));
+            candidates.swap(left);
+        }
+        return std::vector<int>();
+    }
+
+    void serial_flip(SampleSet & mutations, std::vector<Sample> & found, std::vector<int> & flipped, double start_epoch) {
         int calls = 0;
         int progress = 0;
         for (int count = 0; count < constraints.size(); ++count) {
-            auto u = unsat_ind.find(cons_to_ind[count].first);
-            if (u != unsat_ind.end() && u->second.find(cons_to_ind[count].second) != u->second.end()) {
+            if (known_unsat(count)) {
                 continue;
             }
-            z3::expr & cond = constraints[count];
-            opt.push();
-            solver.push();
-            opt.add(!cond);
-            solver.add(!cond);
-            for (z3::expr & soft : soft_constraints[count]) {
-                assert_soft(soft);
-            }
-            struct timespec end;
-            clock_gettime(CLOCK_REALTIME, &end);
-            double elapsed = duration(&start_time, &end);
-
-            double cost = calls ? (elapsed - start_epoch) / calls : 0.0;
-            cost *= constraints.size() - count;
-            if (max_time/3.0 + start_epoch > max_time && elapsed + cost > max_time) {
-                std::cout << "Stopping: slow\n";
-                finish();
-            }
             z3::check_result result = z3::unknown;
-            if (cost * rand() <= (max_time/3.0 + start_epoch - elapsed) * RAND_MAX) {
-                result = solve();
+            if (should_flip(constraints.size() - count, calls, start_epoch)) {
+                result = flip(count);
                 ++calls;
             }
             if (result == z3::sat) {
-                std::string new_string = model_string(model, ind);
-                if (mutations.find(new_string) == mutations.end()) {
-                    mutations.insert(new_string);
+                Sample new_sample = model_sample(model, ind, ind_layout);
+                if (mutations.insert(new_sample)) {
+                    found.push_back(new_sample);
+                    flipped.push_back(count);
                     output(model, 1);
-                    flips += 1;
+                    stats.flips += 1;
                 } else {
                     // std::cout << "repeated\n";
                 }
             } else if (result == z3::unsat) {
                 // std::cout << "unsat\n";
-                if (!is_ind(count)) {
-                    unsat_internal.insert(count);
-                } else if (cons_to_ind[count].first >= 0) {
-                    unsat_ind[cons_to_ind[count].first].insert(cons_to_ind[count].second);
-                    ++unsat_ind_count;
+                record_unsat(count);
+                std::vector<int> candidates;
+                for (int j : pinned(count)) {
+                    if (!known_unsat(j))
+                        candidates.push_back(j);
+                }
+                if (candidates.size() > 1) {
+                    std::vector<std::pair<int, Sample>> more;
+                    for (int j : generalise(candidates, more, calls)) {
+                        record_unsat(j);
+                        ++stats.generalised;
+                    }
+                    for (std::pair<int, Sample> & m : more) {
+                        if (mutations.insert(m.second)) {
+                            found.push_back(m.second);
+                            flipped.push_back(m.first);
+                            if (convert)
+                                output(gen_model(m.second, ind, ind_layout), 1);
+                            else
+                                output(m.second, 1);
+                            stats.flips += 1;
+                        }
+                    }
                 }
             }
-            opt.pop();
-            solver.pop();
+            maybe_write_stats();
             double new_progress = 80.0 * (double)(count + 1) / (double)constraints.size();
-            while (progress < new_progress) {
+            while (!quiet && progress < new_progress) {
                 ++progress;
-                std::cout << '=' << std::flush;
+                log() << '=' << std::flush;
             }
         }
-        std::cout << '\n';
-
-        std::vector<std::string> initial(mutations.begin(), mutations.end());
-        std::vector<std::string> sigma = initial;
-
-        for (int k = 2; k <= 6; ++k) {
-                std::cout << "Combining " << k << " mutations\n";
-                std::vector<std::string> new_sigma;
-                int all = 0;
-                int good = 0;
+        if (!quiet)
+            log() << '\n';
+    }
 
-                for (std::string b_string : sigma) {
-                    for (std::string c_string : initial) {
-                        size_t pos_a = 0;
-                        size_t pos_b = 0;
-                        size_t pos_c = 0;
-                        std::string candidate;
-                        for (z3::func_decl & w : ind) {
-                            if (w.range().is_array()) {
-                                int arity = 0;
-                                z3::sort s = w.range().array_range();
-                                combine_function(m_string, b_string, c_string,
-                                                 pos_a, pos_b, pos_c, arity, s, candidate);
-                            } else if (w.is_const()) {
-                                z3::sort s = w.range();
-                                std::string num = combine(m_string.c_str() + pos_a, b_string.c_str() + pos_b, c_string.c_str() + pos_c, s);
-                                pos_a = m_string.find('\0', pos_a) + 1;
-                                pos_b = b_string.find('\0', pos_b) + 1;
-                                pos_c = c_string.find('\0', pos_c) + 1;
-                                candidate += num + '\0';
-                            } else {
-                                int arity = w.arity();
-                                z3::sort s = w.range();
-                                combine_function(m_string, b_string, c_string,
-                                                 pos_a, pos_b, pos_c, arity, s, candidate);
+    // Spreads the flips of the epoch over this sampler and its flip workers.
+    // Each flip worker rebuilds the epoch's constraints from m_sample in its
+    // own context; the new mutations are validated here once all are done.
+    void parallel_flip(Sample const & m_sample, SampleSet & mutations, std::vector<Sample> & found, std::vector<int> & flipped, double start_epoch) {
+        FlipQueue queue(flip_workers.size() + 1, constraints.size());
+        std::mutex lock;
+        std::atomic<int> calls(0);
+        auto work = [&](SMTSampler * s, int id) {
+            try {
+                if (s != this) {
+                    s->push();
+                    s->build_constraints(m_sample);
+                }
+                int count;
+                while (queue.pop(id, count)) {
+                    {
+                        std::lock_guard<std::mutex> guard(lock);
+                        if (known_unsat(count))
+                            continue;
+                    }
+                    if (!s->should_flip(queue.remaining() + 1, calls, start_epoch))
+                        continue;
+                    z3::check_result result = s->flip(count);
+                    ++calls;
+                    if (s == this)
+                        maybe_write_stats();
+                    if (result == z3::sat) {
+                        Sample new_sample = s->model_sample(s->model, s->ind, s->ind_layout);
+                        std::lock_guard<std::mutex> guard(lock);
+                        if (mutations.insert(new_sample)) {
+                            found.push_back(new_sample);
+                            flipped.push_back(count);
+                        }
+                    } else if (result == z3::unsat) {
+                        std::vector<int> candidates;
+                        {
+                            std::lock_guard<std::mutex> guard(lock);
+                            record_unsat(count);
+                            for (int j : s->pinned(count)) {
+                                if (!known_unsat(j))
+                                    candidates.push_back(j);
                             }
                         }
-                        if (mutations.find(candidate) == mutations.end()) {
-                            mutations.insert(candidate);
-                            bool valid;
-                            if (convert) {
-                                z3::model cand = gen_model(candidate, ind);
-                                valid = output(cand, k);
-                            } else {
-                                valid = output(candidate, k);
+                        if (candidates.size() > 1) {
+                            std::vector<std::pair<int, Sample>> more;
+                            int used = 0;
+                            std::vector<int> unsat = s->generalise(candidates, more, used);
+                            calls += used;
+                            std::lock_guard<std::mutex> guard(lock);
+                            for (int j : unsat) {
+                                record_unsat(j);
+                                ++s->stats.generalised;
                             }
-                            ++all;
-                            if (valid) {
-                                ++good;
-                                new_sigma.push_back(candidate);
+                            for (std::pair<int, Sample> & m : more) {
+                                if (mutations.insert(m.second)) {
+                                    found.push_back(m.second);
+                                    flipped.push_back(m.first);
+                                }
                             }
                         }
                     }
                 }
-                double accuracy = (double)good / (double)all;
-                std::cout << "Valid: " << good << " / " << all << " = " << accuracy << '\n';
-                print_stats();
-                if (all == 0 || accuracy < 0.1)
-                    break;
-                sigma = new_sigma;
+            } catch (stop_sampling) {
+            } catch (z3::exception except) {
+                if (!store->stop)
+                    log() << "Exception: " << except << "\n";
+            }
+            if (s != this) {
+                s->pop();
+            }
+        };
+        std::vector<std::thread> threads;
+        for (int i = 0; i < flip_workers.size(); ++i) {
+            threads.emplace_back(work, flip_workers[i], i + 1);
+        }
+        work(this, 0);
+        for (std::thread & t : threads) {
+            t.join();
+        }
+        for (SMTSampler * w : flip_workers) {
+            stats.merge(w->stats);
+            w->stats = SamplerStats();
+        }
+        if (store->stop) {
+            finish();
         }
 
-        epochs += 1;
-        opt.pop();
-        solver.pop();
+        for (Sample & new_sample : found) {
+            if (convert) {
+                z3::model cand = gen_model(new_sample, ind, ind_layout);
+                output(cand, 1);
+            } else {
+                output(new_sample, 1);
+            }
+            stats.flips += 1;
+        }
+    }
+
+    // Checks the candidates of the batch against the bit-blasted goal, and
+    // only converts and outputs the ones that satisfy it.
+    void flush_batch(std::vector<Combination> & pending, int nmut, std::vector<int> const & flipped, int & all, int & good, std::vector<Combination> & new_sigma) {
+        std::vector<uint64_t> mask;
+        batch.eval(mask);
+        for (int i = 0; i < pending.size(); ++i) {
+            if (!((mask[i / 64] >> (i % 64)) & 1)) {
+                store->samples += 1;
+                judge(pending[i], false, flipped, all, good, new_sigma);
+                continue;
+            }
+            z3::model cand = gen_model(pending[i].sample, ind, ind_layout);
+            judge(pending[i], output(cand, nmut), flipped, all, good, new_sigma);
+        }
+        pending.clear();
+        batch.clear();
+    }
+
+    // Checks the candidates on this sampler and its check workers, each in
+    // its own context, and then records the valid ones in order.
+    void check_batch(std::vector<Combination> & pending, int nmut, std::vector<int> const & flipped, int & all, int & good, std::vector<Combination> & new_sigma) {
+        store->samples += pending.size();
+        if (store->stop) {
+            finish();
+        }
+        if (elapsed() >= max_time) {
+            log() << "Stopping: timeout\n";
+            finish();
+        }
+        std::vector<char> valid(pending.size());
+        std::atomic<int> next(0);
+        check_pool->run([&](int id) {
+            SMTSampler * s = id == 0 ? this : check_workers[id - 1];
+            try {
+                for (int i = next++; i < pending.size(); i = next++)
+                    valid[i] = s->check(pending[i].sample, nmut);
+            } catch (z3::exception except) {
+                if (!store->stop)
+                    log() << "Exception: " << except << "\n";
+            }
+        });
+        if (store->stop) {
+            finish();
+        }
+        for (int i = 0; i < pending.size(); ++i) {
+            if (valid[i])
+                record(pending[i].sample, nmut);
+            judge(pending[i], valid[i], flipped, all, good, new_sigma);
+        }
+        pending.clear();
+    }
+
+    // Adds the time and coverage of the check workers to this sampler.
+    void merge_check_workers() {
+        for (SMTSampler * w : check_workers) {
+            stats.merge(w->stats);
+            w->stats = SamplerStats();
+            coverage_merge(c, w->c);
+        }
+    }
+
+    // Counts a combination of the flips of the epoch, and keeps it for the
+    // next level if it is valid.
+    void judge(Combination & comb, bool valid, std::vector<int> const & flipped, int & all, int & good, std::vector<Combination> & new_sigma) {
+        ++all;
+        // A disjoint pair says nothing of the chances of its flips.
+        for (int f : comb.parts) {
+            std::pair<int, int> const & key = cons_to_ind[flipped[f]];
+            if (comb.disjoint || key.first < 0)
+                continue;
+            std::pair<int, int> & yield = flip_yield[key.first][key.second];
+            ++yield.first;
+            yield.second += valid;
+        }
+        if (valid) {
+            ++good;
+            new_sigma.push_back(std::move(comb));
+        }
+    }
+
+    // Estimated chance that a combination with the flip of constraints[count]
+    // is valid, from the combinations tried with the flip of the same bit in
+    // this and earlier epochs.
+    double flip_score(int count) {
+        std::pair<int, int> const & key = cons_to_ind[count];
+        if (key.first < 0)
+            return 0.5;
+        auto v = flip_yield.find(key.first);
+        if (v == flip_yield.end())
+            return 0.5;
+        auto b = v->second.find(key.second);
+        if (b == v->second.end())
+            return 0.5;
+        return (b->second.second + 1.0) / (b->second.first + 2.0);
     }
 
-    void add_constraints(z3::expr exp, z3::expr val, int count) {
+    // Adds the constraints that keep exp at val, one per bit, except for the
+    // bits set in fixed, which no solution can flip.
+    void add_constraints(z3::expr exp, z3::expr val, int count, uint64_t const * fixed = NULL) {
         switch (val.get_sort().sort_kind()) {
         case Z3_BV_SORT:
         {
             std::vector<z3::expr> soft;
+            int added = 0;
             for (int i = 0; i < val.get_sort().bv_size(); ++i) {
+                if (fixed && (fixed[i / 64] >> (i % 64)) & 1)
+                    continue;
+                ++added;
                 all_ind_count += (count >= 0);
                 cons_to_ind.emplace_back(count, i);
 
@@ -595,10 +2467,13 @@ public:
                 r = r.simplify();
                 constraints.push_back(exp.extract(i, i) == r);
                 // soft.push_back(exp.extract(i, i) == r);
-                if (strategy == STRAT_SMTBIT)
+                if (strategy == STRAT_SMTBIT) {
                     assert_soft(exp.extract(i, i) == r);
+                    if (engine == ENGINE_RELAX)
+                        soft_owner[soft_literals.back()] = constraints.size() - 1;
+                }
             }
-            for (int i = 0; i < val.get_sort().bv_size(); ++i) {
+            for (int i = 0; i < added; ++i) {
                 soft_constraints.push_back(soft);
             }
             if (strategy == STRAT_SMTBV)
@@ -607,373 +2482,367 @@ public:
         }
         case Z3_BOOL_SORT:
         {
+            if (fixed && (fixed[0] & 1))
+                break;
             all_ind_count += (count >= 0);
             cons_to_ind.emplace_back(count, 0);
             constraints.push_back(exp == val);
             std::vector<z3::expr> soft;
             soft_constraints.push_back(soft);
             assert_soft(exp == val);
+            if (engine == ENGINE_RELAX)
+                soft_owner[soft_literals.back()] = constraints.size() - 1;
             break;
         }
         default:
-            std::cout << "Invalid sort\n";
-            exit(1);
-        }
-    }
-
-    char const * parse_function(std::string const & m_string, size_t & pos, int arity, std::unordered_map<std::string,triple> & values, int index) {
-        bool is_array = false;
-        if (arity == 0) {
-            is_array = true;
-            arity = 1;
-        }
-        assert(m_string.c_str()[pos] == is_array? '[' : '(');
-        ++pos;
-        int num = atoi(m_string.c_str() + pos);
-        pos = m_string.find('\0', pos) + 1;
-
-        char const * def = m_string.c_str() + pos;
-        pos = m_string.find('\0', pos) + 1;
-
-        for (int j = 0; j < num; ++j) {
-            int start = pos;
-            for (int k = 0; k < arity; ++k) {
-                pos = m_string.find('\0', pos) + 1;
-            }
-            std::string args = m_string.substr(start, pos - start);
-            values[args].a[index] = m_string.c_str() + pos;
-            pos = m_string.find('\0', pos) + 1;
-        }
-        assert(m_string.c_str()[pos] == is_array ? ']' : ')');
-        ++pos;
-        return def;
-    }
-
-    unsigned char hex(char c) {
-        if ('0' <= c && c <= '9')
-            return c - '0';
-        else if ('a' <= c && c <= 'f')
-            return 10 + c - 'a';
-        std::cout << "Invalid hex\n";
-        exit(1);
-    }
-
-    std::string combine(char const * val_a, char const * val_b, char const * val_c, z3::sort s) {
-        std::string num;
-        while (*val_a) {
-            unsigned char a = hex(*val_a);
-            unsigned char b = hex(*val_b);
-            unsigned char c = hex(*val_c);
-            unsigned char r = a ^ ((a ^ b) | (a ^ c));
-            char n;
-            if (r <= 9)
-                n = '0' + r;
-            else
-                n = 'a' + r - 10;
-            num += n;
-            ++val_a;
-            ++val_b;
-            ++val_c;
-        }
-        return num;
-    }
-
-    void combine_function(std::string const & str_a, std::string const & str_b, std::string const & str_c,
-                          size_t & pos_a, size_t & pos_b, size_t & pos_c, int arity, z3::sort s, std::string & candidate) {
-
-        std::unordered_map<std::string,triple> values;
-        char const * def_a = parse_function(str_a, pos_a, arity, values, 0);
-        char const * def_b = parse_function(str_b, pos_b, arity, values, 1);
-        char const * def_c = parse_function(str_c, pos_c, arity, values, 2);
-
-        candidate += arity == 0 ? "[" : "(";
-        candidate += std::to_string(values.size()) + '\0';
-        std::string def = combine(def_a, def_b, def_c, s);
-        candidate += def + '\0';
-        for (auto value : values) {
-            char const * val_a = value.second.a[0];
-            if (!val_a)
-                val_a = def_a;
-            char const * val_b = value.second.a[1];
-            if (!val_b)
-                val_b = def_b;
-            char const * val_c = value.second.a[2];
-            if (!val_c)
-                val_c = def_c;
-            std::string val = combine(val_a, val_b, val_c, s);
-            candidate += value.first;
-            candidate += val + '\0';
-        }
-        candidate += arity == 0 ? "]" : ")";
+            throw sampler_error{"Invalid sort", 1};
+        }
     }
 
     bool is_ind(int count) {
         return !flip_internal || count >= internal.size();
     }
 
-    z3::model gen_model(std::string candidate, std::vector<z3::func_decl> ind) {
+    z3::model gen_model(Sample const & candidate, std::vector<z3::func_decl> & decls, SampleLayout const & layout) {
         z3::model m(c);
-        size_t pos = 0;
-        for (z3::func_decl & v : ind) {
-            if (v.range().is_array()) {
-                assert(candidate.c_str()[pos] == '[');
-                ++pos;
-                int num = atoi(candidate.c_str() + pos);
-                pos = candidate.find('\0', pos) + 1;
-
-                z3::expr def = value(candidate.c_str() + pos, v.range().array_range());
-                pos = candidate.find('\0', pos) + 1;
-
+        std::vector<uint64_t> a;
+        size_t pos = layout.words;
+        for (int i = 0; i < decls.size(); ++i) {
+            z3::func_decl & v = decls[i];
+            SampleLayout::Field const & f = layout.fields[i];
+            if (!f.is_table) {
+                a.resize(SampleLayout::nwords(f.width));
+                layout.get(candidate, f, a.data());
+                z3::expr val = value(a.data(), v.range());
+                m.add_const_interp(v, val);
+                continue;
+            }
+            uint64_t num = candidate[pos];
+            z3::sort range = f.is_array ? v.range().array_range() : v.range();
+            z3::expr def = value(&candidate[pos + 1], range);
+            z3::func_decl fd = v;
+            if (f.is_array) {
                 Z3_sort domain_sort[1] = { v.range().array_domain() };
-                Z3_sort range_sort = v.range().array_range();
+                Z3_sort range_sort = range;
                 Z3_func_decl decl = Z3_mk_fresh_func_decl(c, "k", 1, domain_sort, range_sort);
-                z3::func_decl fd(c, decl);
-
-                z3::func_interp f = m.add_func_interp(fd, def);
-
-                for (int j = 0; j < num; ++j) {
-                    z3::expr arg = value(candidate.c_str() + pos, v.range().array_domain());
-                    pos = candidate.find('\0', pos) + 1;
-                    z3::expr val = value(candidate.c_str() + pos, v.range().array_range());
-                    pos = candidate.find('\0', pos) + 1;
-
-                    z3::expr_vector args(c);
-                    args.push_back(arg);
-                    f.add_entry(args, val);
+                fd = z3::func_decl(c, decl);
+            }
+            z3::func_interp fi = m.add_func_interp(fd, def);
+            size_t e = pos + 1 + f.val_words;
+            for (uint64_t j = 0; j < num; ++j) {
+                z3::expr_vector args(c);
+                for (int k = 0; k < f.arg_width.size(); ++k) {
+                    z3::sort s = f.is_array ? v.range().array_domain() : v.domain(k);
+                    args.push_back(value(&candidate[e], s));
+                    e += SampleLayout::nwords(f.arg_width[k]);
                 }
+                z3::expr val = value(&candidate[e], range);
+                fi.add_entry(args, val);
+                e += f.val_words;
+            }
+            if (f.is_array) {
                 z3::expr array = as_array(fd);
                 m.add_const_interp(v, array);
-                assert(candidate.c_str()[pos] == ']');
-                ++pos;
-            } else if (v.is_const()) {
-                z3::expr a = value(candidate.c_str() + pos, v.range());
-                pos = candidate.find('\0', pos) + 1;
-
-                m.add_const_interp(v, a);
-            } else {
-                assert(candidate.c_str()[pos] == '(');
-                ++pos;
-                int num = atoi(candidate.c_str() + pos);
-                pos = candidate.find('\0', pos) + 1;
-
-                z3::expr def = value(candidate.c_str() + pos, v.range());
-                pos = candidate.find('\0', pos) + 1;
-
-                z3::func_interp f = m.add_func_interp(v, def);
-
-                for (int j = 0; j < num; ++j) {
-                    z3::expr_vector args(c);
-                    for (int k = 0; k < v.arity(); ++k) {
-                        z3::expr arg = value(candidate.c_str() + pos, v.domain(k));
-                        pos = candidate.find('\0', pos) + 1;
-                        args.push_back(arg);
-                    }
-                    z3::expr val = value(candidate.c_str() + pos, v.range());
-                    pos = candidate.find('\0', pos) + 1;
-
-                    f.add_entry(args, val);
-                }
-                assert(candidate.c_str()[pos] == ')');
-                ++pos;
             }
+            pos += SampleLayout::table_size(f, num);
         }
         return m;
     }
 
     bool output(z3::model m, int nmut) {
-        std::string sample;
+        Sample sample;
         if (convert) {
-            struct timespec start, end;
-            clock_gettime(CLOCK_REALTIME, &start);
+            PhaseTimer timer(stats.convert);
             z3::model converted = res0->convert_model(m);
-            sample = model_string(converted, variables);
-            clock_gettime(CLOCK_REALTIME, &end);
-            convert_time += duration(&start, &end);
+            sample = model_sample(converted, variables, var_layout);
         } else {
-            sample = model_string(m, ind);
+            sample = model_sample(m, ind, ind_layout);
         }
         return output(sample, nmut);
     }
 
-    bool output(std::string sample, int nmut) {
-        samples += 1;
-
-        struct timespec start, middle;
-        clock_gettime(CLOCK_REALTIME, &start);
+    bool output(Sample const & sample, int nmut) {
+        store->samples += 1;
 
-        double elapsed = duration(&start_time, &start);
-        if (elapsed >= max_time) {
-            std::cout << "Stopping: timeout\n";
+        if (store->stop) {
             finish();
         }
+        if (elapsed() >= max_time) {
+            log() << "Stopping: timeout\n";
+            finish();
+        }
+        bool valid = check(sample, nmut);
+        if (valid)
+            record(sample, nmut);
+        return valid;
+    }
 
-        z3::model m = gen_model(sample, variables);
-        z3::expr b = evaluate(m, smt_formula, true, 0);
+    // Checks a sample against the formula and, if it is valid, adds its
+    // coverage.
+    bool check(Sample const & sample, int nmut) {
+        PhaseTimer check_timer(stats.check);
 
-        bool valid = b.bool_value() == Z3_L_TRUE;
+        // Samples straight from the solver are few, and are still checked by
+        // z3 to catch any disagreement with the native evaluator.
+        z3::model m(c);
+        z3::expr b(c);
+        bool native = evaluator.ok() && nmut > 1;
+        bool valid;
+        if (native) {
+            valid = evaluator.check(sample);
+        } else {
+            m = gen_model(sample, variables, var_layout);
+            b = evaluate(m, smt_formula, true, 0);
+            valid = b.bool_value() == Z3_L_TRUE;
+        }
         if (valid) {
-	    auto res = all_mutations.insert(sample);
-	    if (res.second) {
-                results_file << nmut << ": " << sample << '\n';
-	    }
-	    ++valid_samples;
-            clock_gettime(CLOCK_REALTIME, &middle);
-	    evaluate(m, smt_formula, true, 2);
+            check_timer.stop();
+            PhaseTimer cov_timer(stats.coverage);
+            if (native)
+                m = gen_model(sample, variables, var_layout);
+            evaluate(m, smt_formula, true, 2);
 	} else if (nmut <= 1) {
-	    std::cout << "Solution check failed, nmut = " << nmut << "\n";
-	    std::cout << b << "\n";
-	    exit(0);
+	    std::ostringstream out;
+	    out << "Solution check failed, nmut = " << nmut << "\n" << b;
+	    throw sampler_error{out.str(), 0};
 	}
+        return valid;
+    }
 
-        struct timespec end;
-        clock_gettime(CLOCK_REALTIME, &end);
-        if (valid) {
-            cov_time += duration(&middle, &end);
-            check_time += duration(&start, &middle);
-        } else {
-            check_time += duration(&start, &end);
+    // Adds a valid sample to the samples of the run. The queue of start() is
+    // pushed to without the lock, since it waits for the program taking the
+    // samples, which may itself want the lock for Sampler::stats(). The
+    // writer is pushed to under it, so that a checkpoint sees the same
+    // samples in the set and in the file; it only waits for its own thread.
+    void record(Sample const & sample, int nmut) {
+        bool queue = false;
+        {
+            std::lock_guard<std::mutex> lock(store->mutex);
+            if (!store->all_mutations.insert(sample)) {
+            } else if (store->collect) {
+                store->collected.push_back(sample);
+                store->collected_nmut.push_back(nmut);
+            } else if (store->queue) {
+                queue = true;
+            } else {
+                store->writer.push(nmut, sample);
+            }
         }
-        return valid;
+        if (queue)
+            store->queue->push(nmut, sample);
+        ++store->valid_samples;
     }
 
+    // Stops the whole run and unwinds to sample_epochs().
     void finish() {
-        print_stats();
-        results_file.close();
-        exit(0);
+        request_stop();
+        throw stop_sampling();
     }
 
-    z3::check_result solve() {
-        struct timespec start;
-        clock_gettime(CLOCK_REALTIME, &start);
-        double elapsed = duration(&start_time, &start);
-        if (valid_samples >= max_samples) {
-            std::cout << "Stopping: samples\n";
+    z3::check_result solve(bool is_flip = false) {
+        z3::expr_vector assumptions(c);
+        return solve(assumptions, is_flip);
+    }
+
+    // Flips are checked under the adaptive timeout, and everything else,
+    // including the plain check a flip falls back to, under max_timeout.
+    z3::check_result solve(z3::expr_vector const & assumptions, bool is_flip = false) {
+        if (store->stop) {
+            finish();
+        }
+        if (store->valid_samples >= max_samples) {
+            log() << "Stopping: samples\n";
             finish();
         }
-        if (elapsed >= max_time) {
-            std::cout << "Stopping: timeout\n";
+        if (elapsed() >= max_time) {
+            log() << "Stopping: timeout\n";
             finish();
         }
+        PhaseTimer timer(stats.solve);
+        use_timeout(is_flip ? timeout : max_timeout);
+        double started = monotonic_now();
         z3::check_result result = z3::unknown;
-        try {
-            result = opt.check();
-        } catch (z3::exception except) {
-            std::cout << "Exception: " << except << "\n";
+        if (engine == ENGINE_RELAX) {
+            result = relax(assumptions);
+        } else {
+            try {
+                result = opt.check(assumptions);
+            } catch (z3::exception except) {
+                if (!store->stop)
+                    log() << "Exception: " << except << "\n";
+            }
+            if (result == z3::sat)
+                model = opt.get_model();
         }
-        if (result == z3::sat) {
-            model = opt.get_model();
+        // The time under the timeout of the flip, without the fallback,
+        // which would push the timeout up towards max_timeout.
+        double adaptive = monotonic_now() - started;
+        if (result != z3::sat && store->stop) {
+            finish();
         } else if (result == z3::unknown) {
+            ++stats.timeouts;
+            use_timeout(max_timeout);
             try {
-                result = solver.check();
+                result = solver.check(assumptions);
             } catch (z3::exception except) {
-                std::cout << "Exception: " << except << "\n";
+                log() << "Exception: " << except << "\n";
             }
-            std::cout << "MAX-SMT timed out: " << result << "\n";
+            log() << "MAX-SMT timed out: " << result << "\n";
             if (result == z3::sat) {
                 model = solver.get_model();
             }
         }
-        struct timespec end;
-        clock_gettime(CLOCK_REALTIME, &end);
-        solver_time += duration(&start, &end);
-        solver_calls += 1;
+        stats.solver_calls += 1;
+        timer.stop();
+        if (is_flip)
+            adapt_timeout(adaptive);
 
         return result;
     }
 
-    std::string model_string(z3::model m, std::vector<z3::func_decl> ind) {
-        std::string s;
-        for (z3::func_decl & v : ind) {
-            if (v.range().is_array()) {
+    // Sets the timeout of the solvers, if it changed.
+    void use_timeout(unsigned ms) {
+        if (ms == solver_timeout)
+            return;
+        solver_timeout = ms;
+        params.set("timeout", ms);
+        opt.set(params);
+        solver.set(params);
+    }
+
+    // Every 32 flips, sets the timeout of flips to 4 times the 95th
+    // percentile of their recent solve times, between 10 ms and max_timeout,
+    // so that the few flips that get stuck are given up on early. Other
+    // checks keep max_timeout.
+    void adapt_timeout(double t) {
+        latencies.add(t);
+        if (!adaptive_timeout || latencies.calls() % 32)
+            return;
+        timeout = std::min(max_timeout, std::max(10u, (unsigned)(4000.0 * latencies.p95())));
+    }
+
+    // Looks for a model of the hard constraints and assumptions that keeps
+    // as many soft constraints as it can: each check is made under the
+    // literals of the soft constraints still kept, and the ones in the unsat
+    // core of a failed check are dropped. Returns unsat once a core has no
+    // soft literal left to drop, and unknown if a check times out, in which
+    // case solve() falls back to a plain check.
+    z3::check_result relax(z3::expr_vector const & assumptions) {
+        std::vector<z3::expr> kept = soft_literals;
+        relaxed.clear();
+        while (true) {
+            z3::expr_vector literals(c);
+            for (unsigned i = 0; i < assumptions.size(); ++i)
+                literals.push_back(assumptions[i]);
+            for (z3::expr & lit : kept)
+                literals.push_back(lit);
+            z3::check_result result = z3::unknown;
+            try {
+                result = solver.check(literals);
+            } catch (z3::exception except) {
+                log() << "Exception: " << except << "\n";
+            }
+            if (result == z3::sat)
+                model = solver.get_model();
+            if (result != z3::unsat)
+                return result;
+            z3::expr_vector core = solver.unsat_core();
+            std::unordered_set<Z3_ast> in_core;
+            for (unsigned i = 0; i < core.size(); ++i)
+                in_core.insert(core[i]);
+            size_t size = kept.size();
+            kept.erase(std::remove_if(kept.begin(), kept.end(), [&](z3::expr const & lit) {
+                if (!in_core.count(lit))
+                    return false;
+                relaxed.push_back(lit);
+                return true;
+            }), kept.end());
+            if (kept.size() == size)
+                return z3::unsat;
+            ++stats.relaxations;
+        }
+    }
+
+    // Packs the values m gives to decls into a sample laid out by layout.
+    // Symbols m leaves unconstrained are 0.
+    Sample model_sample(z3::model m, std::vector<z3::func_decl> & decls, SampleLayout const & layout) {
+        Sample s(layout.words, 0);
+        std::vector<uint64_t> a;
+        for (int i = 0; i < decls.size(); ++i) {
+            z3::func_decl & v = decls[i];
+            SampleLayout::Field const & f = layout.fields[i];
+            if (!f.is_table) {
+                a.assign(SampleLayout::nwords(f.width), 0);
+                z3::expr b = m.get_const_interp(v);
+                if ((Z3_ast)b)
+                    scalar(b, f.is_bool, f.width, a.data());
+                layout.set(s, f, a.data());
+                continue;
+            }
+            size_t pos = s.size();
+            s.resize(pos + 1 + f.val_words, 0);
+            if (!f.is_array) {
+                if (m.has_interp(v))
+                    add_entries(s, pos, f, m.get_func_interp(v));
+            } else if ((Z3_ast)m.get_const_interp(v)) {
                 z3::expr e = m.get_const_interp(v);
-                Z3_func_decl as_array = Z3_get_as_array_func_decl(c, e);
-                if (as_array) {
-		    z3::func_interp f = m.get_func_interp(to_func_decl(c, as_array));
-		    std::string num = "[";
-		    num += std::to_string(f.num_entries());
-		    s += num + '\0';
-		    std::string def = bv_string(f.else_value(), c);
-		    s += def + '\0';
-		    for (int j = 0; j < f.num_entries(); ++j) {
-		        std::string arg = bv_string(f.entry(j).arg(0), c);
-		        std::string val = bv_string(f.entry(j).value(), c);
-		        s += arg + '\0';
-		        s += val + '\0';
-		    }
-		    s += "]";
+                if (Z3_is_as_array(c, e)) {
+                    add_entries(s, pos, f, m.get_func_interp(to_func_decl(c, Z3_get_as_array_func_decl(c, e))));
                 } else {
-                    std::vector<std::string> args;
-                    std::vector<std::string> values;
-                    while (e.decl().name().str() == "store") {
-                        std::string arg = bv_string(e.arg(1), c);
-                        if (std::find(args.begin(), args.end(), arg) != args.end())
-                            continue;
-                        args.push_back(arg);
-                        values.push_back(bv_string(e.arg(2), c));
+                    // A chain of stores over a constant array; the outermost
+                    // store of an index is the one that counts.
+                    std::vector<uint64_t> key(f.key_words);
+                    while (e.decl().decl_kind() == Z3_OP_STORE) {
+                        scalar(e.arg(1), f.arg_bool[0], f.arg_width[0], key.data());
+                        if (!find_entry(s, pos, f, key.data())) {
+                            size_t entry = s.size();
+                            s.insert(s.end(), key.begin(), key.end());
+                            s.resize(entry + f.key_words + f.val_words, 0);
+                            scalar(e.arg(2), f.is_bool, f.width, &s[entry + f.key_words]);
+                            ++s[pos];
+                        }
                         e = e.arg(0);
                     }
-		    std::string num = "[";
-		    num += std::to_string(args.size());
-		    s += num + '\0';
-		    std::string def = bv_string(e.arg(0), c);
-		    s += def + '\0';
-		    for (int j = args.size() - 1; j >= 0; --j) {
-		        std::string arg = args[j];
-		        std::string val = values[j];
-		        s += arg + '\0';
-		        s += val + '\0';
-		    }
-		    s += "]";
-                }
-            } else if (v.is_const()) {
-                z3::expr b = m.get_const_interp(v);
-                Z3_ast ast = b;
-                switch (v.range().sort_kind()) {
-                case Z3_BV_SORT:
-                {
-                    if (!ast) {
-                        s += bv_string(c.bv_val(0, v.range().bv_size()), c) + '\0';
-                    } else {
-                        s += bv_string(b, c) + '\0';
-		    }
-                    break;
-                }
-                case Z3_BOOL_SORT:
-		{
-                    if (!ast) {
-                        s += std::to_string(false) + '\0';
-                    } else {
-                        s += std::to_string(b.bool_value() == Z3_L_TRUE) + '\0';
-		    }
-                    break;
-		}
-                default:
-                        std::cout << "Invalid sort\n";
-                        exit(1);
-                }
-            } else {
-                z3::func_interp f = m.get_func_interp(v);
-                std::string num = "(";
-                num += std::to_string(f.num_entries());
-                s += num + '\0';
-                std::string def = bv_string(f.else_value(), c);
-                s += def + '\0';
-                for (int j = 0; j < f.num_entries(); ++j) {
-                    for (int k = 0; k < f.entry(j).num_args(); ++k) {
-                        std::string arg = bv_string(f.entry(j).arg(k), c);
-                        s += arg + '\0';
-                    }
-                    std::string val = bv_string(f.entry(j).value(), c);
-                    s += val + '\0';
+                    if (e.decl().decl_kind() == Z3_OP_CONST_ARRAY)
+                        scalar(e.arg(0), f.is_bool, f.width, &s[pos + 1]);
                 }
-                s += ")";
             }
+            SampleLayout::sort_table(s, f, pos);
         }
         return s;
     }
 
-    double duration(struct timespec * a, struct timespec * b) {
-        return (b->tv_sec - a->tv_sec) + 1.0e-9 * (b->tv_nsec - a->tv_nsec);
+    void scalar(z3::expr const & e, bool is_bool, unsigned width, uint64_t * r) {
+        if (is_bool) {
+            r[0] = e.bool_value() == Z3_L_TRUE;
+        } else {
+            SampleLayout::numeral(e, r, width);
+        }
+    }
+
+    // Appends the entries and default of f to the table at pos.
+    void add_entries(Sample & s, size_t pos, SampleLayout::Field const & f, z3::func_interp fi) {
+        scalar(fi.else_value(), f.is_bool, f.width, &s[pos + 1]);
+        for (unsigned j = 0; j < fi.num_entries(); ++j) {
+            z3::func_entry entry = fi.entry(j);
+            size_t e = s.size();
+            s.resize(e + f.key_words + f.val_words, 0);
+            for (unsigned k = 0; k < entry.num_args(); ++k) {
+                scalar(entry.arg(k), f.arg_bool[k], f.arg_width[k], &s[e]);
+                e += SampleLayout::nwords(f.arg_width[k]);
+            }
+            scalar(entry.value(), f.is_bool, f.width, &s[e]);
+        }
+        s[pos] = fi.num_entries();
+    }
+
+    bool find_entry(Sample const & s, size_t pos, SampleLayout::Field const & f, uint64_t const * key) {
+        size_t e = pos + 1 + f.val_words;
+        for (uint64_t j = 0; j < s[pos]; ++j, e += f.key_words + f.val_words) {
+            if (std::equal(key, key + f.key_words, s.begin() + e))
+                return true;
+        }
+        return false;
     }
 
     z3::expr literal(int v) {
@@ -981,36 +2850,121 @@ public:
     }
 };
 
-int main(int argc, char * argv[]) {
-    int max_samples = 1000000;
-    double max_time = 3600.0;
-    int strategy = STRAT_SMTBIT;
-    if (argc < 2) {
-        std::cout << "Argument required: input file\n";
-        return 0;
-    }
-    bool arg_samples = false;
-    bool arg_time = false;
-    for (int i = 1; i < argc; ++i) {
-        if (strcmp(argv[i], "-n") == 0)
-            arg_samples = true;
-        else if (strcmp(argv[i], "-t") == 0)
-            arg_time = true;
-        else if (strcmp(argv[i], "--smtbit") == 0)
-            strategy = STRAT_SMTBIT;
-        else if (strcmp(argv[i], "--smtbv") == 0)
-            strategy = STRAT_SMTBV;
-        else if (strcmp(argv[i], "--sat") == 0)
-            strategy = STRAT_SAT;
-        else if (arg_samples) {
-            arg_samples = false;
-            max_samples = atoi(argv[i]);
-        } else if (arg_time) {
-            arg_time = false;
-            max_time = atof(argv[i]);
-        }
-    }
-    SMTSampler s(argv[argc-1], max_samples, max_time, strategy);
-    s.run();
-    return 0;
+
+Sampler::Sampler(std::string const & input, Options const & options) : sampler(new SMTSampler(input, options)) {}
+
+Sampler::~Sampler() {
+    cancel();
+    if (thread.joinable())
+        thread.join();
+    delete sampler;
+    delete queue;
+}
+
+bool Sampler::write_samples() {
+    try {
+        sampler->begin(true);
+        sampler->sample_all();
+    } catch (stop_sampling) {
+    } catch (sampler_error & e) {
+        message = e.message;
+        exit_status = e.status;
+    }
+    finished = true;
+    return message.empty();
+}
+
+bool Sampler::start() {
+    sampler->out = &null_stream;
+    queue = new SampleQueue();
+    sampler->store->queue = queue;
+    try {
+        sampler->begin(false);
+    } catch (stop_sampling) {
+        queue->finish();
+        finished = true;
+        return true;
+    } catch (sampler_error & e) {
+        message = e.message;
+        exit_status = e.status;
+        finished = true;
+        return false;
+    }
+    thread = std::thread([this] {
+        try {
+            sampler->sample_all();
+        } catch (stop_sampling) {
+        } catch (sampler_error & e) {
+            sampler->fail(e);
+        } catch (z3::exception except) {
+            sampler->fail(sampler_error{except.msg(), 1});
+        }
+        finished = true;
+        queue->finish();
+    });
+    return true;
+}
+
+bool Sampler::next(Sample & sample, int * nmut) {
+    int n;
+    if (!queue || !queue->pop(sample, n))
+        return stopped();
+    if (nmut)
+        *nmut = n;
+    return true;
+}
+
+bool Sampler::run(std::function<bool(Sample const &, int)> const & callback) {
+    if (!start())
+        return false;
+    Sample sample;
+    int nmut;
+    while (next(sample, &nmut)) {
+        if (!callback(sample, nmut))
+            cancel();
+    }
+    return message.empty();
+}
+
+void Sampler::cancel() {
+    if (queue)
+        queue->close();
+    sampler->request_stop();
+}
+
+// Waits for the sampling thread and takes the error that stopped it.
+bool Sampler::stopped() {
+    if (thread.joinable())
+        thread.join();
+    if (sampler->store->failed && message.empty()) {
+        message = sampler->store->error.message;
+        exit_status = sampler->store->error.status;
+    }
+    return false;
+}
+
+std::vector<std::string> Sampler::names() {
+    return sampler->variable_names();
+}
+
+SampleLayout const & Sampler::layout() {
+    return sampler->var_layout;
+}
+
+SamplerStats Sampler::stats() {
+    if (finished)
+        return sampler->stats;
+    SamplerStats total;
+    std::lock_guard<std::mutex> lock(sampler->store->mutex);
+    for (SamplerStats const & s : sampler->store->published)
+        total.merge(s);
+    return total;
+}
+
+int Sampler::samples() {
+    return sampler->store->samples;
+}
+
+int Sampler::valid_samples() {
+    return sampler->store->valid_samples;
 }
@@ -0,0 +1,113 @@
+#ifndef SMTSAMPLER_H
+#define SMTSAMPLER_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include "sample.h"
+#include "stats.h"
+
+enum {
+STRAT_SMTBIT,
+STRAT_SMTBV,
+STRAT_SAT
+};
+
+enum {
+ENGINE_OPT,
+ENGINE_RELAX
+};
+
+// Settings of a run, as given on the command line.
+struct Options {
+    int max_samples = 1000000;
+    double max_time = 3600.0;
+    int strategy = STRAT_SMTBIT;
+    int engine = ENGINE_OPT;
+    int jobs = 1;
+    int flip_jobs = 1;
+    int check_jobs = 1;
+    bool exact_dedupe = false;
+    bool binary = false;
+    bool assumptions = false;
+    unsigned timeout = 5000;
+    bool adaptive_timeout = true;
+    std::string stats_json;
+    bool has_seed = false;
+    uint64_t seed = 0;
+    double checkpoint = 0.0;
+    bool resume = false;
+    std::string cache_dir;
+    long combine_budget = 0;
+    bool backbone = false;
+    bool components = false;
+    // Prints nothing to stdout; errors are still returned.
+    bool quiet = false;
+};
+
+class SMTSampler;
+class SampleQueue;
+
+// Sampler of the formula in an SMT-LIB file, for use in another program.
+// Either write_samples() writes the samples file as the command line tool
+// does, or start() begins sampling in the background and next() or run()
+// hand over the unique valid samples as they are found, packed as in
+// layout(). Errors are returned, never exited on: error() and status()
+// tell what went wrong and the exit status the tool gives for it. Only
+// write_samples() prints to stdout, as the tool does, unless quiet is set.
+class Sampler {
+    SMTSampler * sampler;
+    SampleQueue * queue = NULL;
+    std::thread thread;
+    std::atomic<bool> finished{false};
+    std::string message;
+    int exit_status = 0;
+
+public:
+    Sampler(std::string const & input, Options const & options);
+    ~Sampler();
+
+    // Samples into input.samples, or input.samples.bin with binary.
+    bool write_samples();
+
+    // Reads the formula and finds its first solution, then samples in a
+    // thread of its own. Checkpoints are not made.
+    bool start();
+
+    // Waits for the next sample. Returns false once sampling has stopped
+    // and every sample was taken, or after cancel().
+    bool next(Sample & sample, int * nmut = NULL);
+
+    // Starts and hands every sample to callback, until it returns false or
+    // sampling stops.
+    bool run(std::function<bool(Sample const &, int)> const & callback);
+
+    // Stops sampling, from any thread; next() then returns false.
+    void cancel();
+
+    // The variables of the samples, once started.
+    std::vector<std::string> names();
+    SampleLayout const & layout();
+
+    // Stats as of the last flips or level of combinations of each job
+    // while sampling, and of the whole run once it has stopped.
+    SamplerStats stats();
+    int samples();
+    int valid_samples();
+
+    std::string const & error() const {
+        return message;
+    }
+
+    int status() const {
+        return exit_status;
+    }
+
+private:
+    bool stopped();
+};
+
+#endif
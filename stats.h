@@ -0,0 +1,197 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <time.h>
+#include <math.h>
+#include <algorithm>
+#include <ostream>
+#include <vector>
+
+// Seconds on the monotonic clock.
+inline double monotonic_now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + 1.0e-9 * t.tv_nsec;
+}
+
+// Seconds of CPU time used by the calling thread.
+inline double thread_cpu_now() {
+    struct timespec t;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+    return t.tv_sec + 1.0e-9 * t.tv_nsec;
+}
+
+// Histogram of durations in nanoseconds. As in HdrHistogram, a value goes
+// to the bucket of its highest bit and the sub_bits bits below it, so every
+// bucket is within 1/32 of the values it holds.
+class Histogram {
+    static const int sub_bits = 5;
+    std::vector<uint64_t> buckets;
+    uint64_t total = 0;
+    uint64_t max_ns = 0;
+
+    static size_t index(uint64_t v) {
+        if (v < (1u << sub_bits))
+            return v;
+        int shift = 63 - __builtin_clzll(v) - sub_bits;
+        return ((size_t)(shift + 1) << sub_bits) + ((v >> shift) & ((1u << sub_bits) - 1));
+    }
+
+    static uint64_t lowest(size_t i) {
+        if (i < (1u << sub_bits))
+            return i;
+        int shift = (i >> sub_bits) - 1;
+        return (uint64_t)((1u << sub_bits) + (i & ((1u << sub_bits) - 1))) << shift;
+    }
+
+public:
+    Histogram() : buckets((64 - sub_bits + 1) << sub_bits) {}
+
+    void add(double seconds) {
+        uint64_t ns = seconds > 0 ? (uint64_t)(seconds * 1.0e9) : 0;
+        ++buckets[index(ns)];
+        ++total;
+        max_ns = std::max(max_ns, ns);
+    }
+
+    void merge(Histogram const & h) {
+        for (size_t i = 0; i < buckets.size(); ++i)
+            buckets[i] += h.buckets[i];
+        total += h.total;
+        max_ns = std::max(max_ns, h.max_ns);
+    }
+
+    uint64_t count() const {
+        return total;
+    }
+
+    double max() const {
+        return max_ns * 1.0e-9;
+    }
+
+    // Smallest duration in seconds such that a fraction p of the values
+    // are at most it, up to the width of its bucket.
+    double percentile(double p) const {
+        uint64_t rank = (uint64_t)ceil(p * total);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < buckets.size(); ++i) {
+            seen += buckets[i];
+            if (seen >= rank && seen > 0)
+                return std::min(lowest(i + 1) - 1, max_ns) * 1.0e-9;
+        }
+        return 0.0;
+    }
+};
+
+// Time spent in one phase of sampling: the total wall and thread CPU time,
+// and the latency of each of its steps.
+struct Phase {
+    Histogram latency;
+    double wall = 0.0;
+    double cpu = 0.0;
+
+    void add(double w, double c) {
+        latency.add(w);
+        wall += w;
+        cpu += c;
+    }
+
+    void merge(Phase const & p) {
+        latency.merge(p.latency);
+        wall += p.wall;
+        cpu += p.cpu;
+    }
+
+    void json(std::ostream & out) const {
+        out << "{\"count\": " << latency.count() << ", \"wall\": " << wall << ", \"cpu\": " << cpu
+            << ", \"p50\": " << latency.percentile(0.5) << ", \"p90\": " << latency.percentile(0.9)
+            << ", \"p99\": " << latency.percentile(0.99) << ", \"max\": " << latency.max() << '}';
+    }
+};
+
+// Adds the time from its construction to stop(), or to its destruction, as
+// one step of a phase.
+class PhaseTimer {
+    Phase & phase;
+    double wall;
+    double cpu;
+    bool running = true;
+
+public:
+    PhaseTimer(Phase & p) : phase(p), wall(monotonic_now()), cpu(thread_cpu_now()) {}
+
+    ~PhaseTimer() {
+        stop();
+    }
+
+    // Returns the wall time of the step.
+    double stop() {
+        if (!running)
+            return 0.0;
+        running = false;
+        double w = monotonic_now() - wall;
+        phase.add(w, thread_cpu_now() - cpu);
+        return w;
+    }
+};
+
+// Phases and counters of one sampler.
+struct SamplerStats {
+    Phase solve;
+    Phase check;
+    Phase coverage;
+    Phase convert;
+    int epochs = 0;
+    int flips = 0;
+    int solver_calls = 0;
+    int relaxations = 0;
+    int timeouts = 0;
+    int unsat_ind = 0;
+    int backbone = 0;
+    int generalised = 0;
+    // Candidates combined from k mutations, and the valid ones among them.
+    long combined[7] = {0};
+    long combined_valid[7] = {0};
+
+    void merge(SamplerStats const & s) {
+        solve.merge(s.solve);
+        check.merge(s.check);
+        coverage.merge(s.coverage);
+        convert.merge(s.convert);
+        epochs += s.epochs;
+        flips += s.flips;
+        solver_calls += s.solver_calls;
+        relaxations += s.relaxations;
+        timeouts += s.timeouts;
+        unsat_ind += s.unsat_ind;
+        backbone = std::max(backbone, s.backbone);
+        generalised += s.generalised;
+        for (int k = 0; k < 7; ++k) {
+            combined[k] += s.combined[k];
+            combined_valid[k] += s.combined_valid[k];
+        }
+    }
+
+    void json(std::ostream & out) const {
+        out << "\"epochs\": " << epochs << ", \"flips\": " << flips << ", \"solver_calls\": " << solver_calls
+            << ", \"relaxations\": " << relaxations << ", \"timeouts\": " << timeouts << ", \"unsat_ind\": " << unsat_ind << ", \"backbone\": " << backbone << ", \"generalised\": " << generalised
+            << ", \"combined\": [";
+        for (int k = 2; k < 7; ++k)
+            out << (k > 2 ? ", " : "") << combined[k];
+        out << "], \"combined_valid\": [";
+        for (int k = 2; k < 7; ++k)
+            out << (k > 2 ? ", " : "") << combined_valid[k];
+        out << "], \"phases\": {\"solve\": ";
+        solve.json(out);
+        out << ", \"check\": ";
+        check.json(out);
+        out << ", \"coverage\": ";
+        coverage.json(out);
+        out << ", \"convert\": ";
+        convert.json(out);
+        out << '}';
+    }
+};
+
+#endif
@@ -18,6 +18,8 @@ Revision History:
 --*/
 #include<unordered_map>
 #include<vector>
+#include<mutex>
+#include<cstdint>
 #include "model/model.h"
 #include "ast/ast_pp.h"
 #include "ast/ast_ll_pp.h"
@@ -29,29 +31,184 @@ Revision History:
 #include "model/model_evaluator.h"
 #include "api/api_context.h"
 
-struct coverage_small {
-    unsigned long c0;
-    unsigned long c1;
+// Coverage of the nodes of a formula: which bits of every node registered
+// by visit() have been seen as 0 (c0) and as 1 (c1) in the evaluations
+// since. There is one store per context. Nodes are found by AST id and get
+// dense slots in the order visit() registers them, so the stores of
+// contexts holding translations of the same formula line up slot by slot.
+// The bits of each node start on a word boundary of c0 and c1.
+struct coverage_node {
+    unsigned first;
+    unsigned width;
+    bool seen;
 };
 
-struct coverage_big {
-    std::vector<bool> c0;
-    std::vector<bool> c1;
-};
+struct coverage_store {
+    ast_manager & m;
+    bv_util bv;
+    int mode = 0;
+    std::vector<unsigned> slot;
+    std::vector<coverage_node> nodes;
+    std::vector<uint64_t> c0;
+    std::vector<uint64_t> c1;
+    unsigned covered_bool = 0;
+    unsigned covered_bv = 0;
+    unsigned all_bool = 0;
+    unsigned all_bv = 0;
+
+    coverage_store(ast_manager & m): m(m), bv(m) {}
+
+    // Counts a node seen for the first time.
+    void seen(unsigned width) {
+        if (width == 1)
+            ++all_bool;
+        else
+            all_bv += width;
+    }
+
+    // Counts newly covered bits of a node.
+    void covered(unsigned width, unsigned bits) {
+        if (width == 1)
+            covered_bool += bits;
+        else
+            covered_bv += bits;
+    }
 
-struct coverage_struct {
-    struct coverage_small s;
-    struct coverage_big b;
+    // ORs the value of a node, given as words, into its coverage.
+    void cover(coverage_node & node, uint64_t const * value) {
+        if (!node.seen) {
+            node.seen = true;
+            seen(node.width);
+        }
+        unsigned n = (node.width + 63) / 64;
+        unsigned bits = 0;
+        for (unsigned k = 0; k < n; ++k) {
+            uint64_t mask = k + 1 < n || node.width % 64 == 0 ? ~0ull : (1ull << (node.width % 64)) - 1;
+            uint64_t n0 = ~value[k] & mask & ~c0[node.first + k];
+            uint64_t n1 = value[k] & mask & ~c1[node.first + k];
+            c0[node.first + k] |= n0;
+            c1[node.first + k] |= n1;
+            bits += __builtin_popcountll(n0) + __builtin_popcountll(n1);
+        }
+        covered(node.width, bits);
+    }
 };
 
-typedef struct coverage_struct coverage;
+static std::mutex coverage_lock;
+static std::unordered_map<ast_manager *, coverage_store *> coverage_stores;
+static thread_local coverage_store * active_coverage = nullptr;
+
+static coverage_store * get_coverage(Z3_context ctx) {
+    ast_manager & m = mk_c(ctx)->m();
+    std::lock_guard<std::mutex> lock(coverage_lock);
+    coverage_store * & store = coverage_stores[&m];
+    if (!store)
+        store = new coverage_store(m);
+    return store;
+}
+
+// Mode of the evaluations of this thread in ctx: 0 to only evaluate, 1 to
+// register the nodes of the evaluated formula, 2 to record their coverage.
+Z3_API void coverage_set_mode(Z3_context ctx, int mode) {
+    if (mode == 0) {
+        active_coverage = nullptr;
+        return;
+    }
+    active_coverage = get_coverage(ctx);
+    active_coverage->mode = mode;
+}
+
+// counts receives the bits covered and the bits of all evaluated nodes:
+// Bools covered, Bools, bit-vector bits covered, bit-vector bits. A bit
+// counts as covered once for each value seen.
+Z3_API void coverage_counts(Z3_context ctx, unsigned * counts) {
+    coverage_store * store = get_coverage(ctx);
+    counts[0] = store->covered_bool;
+    counts[1] = store->all_bool;
+    counts[2] = store->covered_bv;
+    counts[3] = store->all_bv;
+}
+
+// ORs the coverage of a seen node of the given width, as its words of c0
+// and c1, into node i of d.
+static void add_coverage(coverage_store * d, unsigned i, unsigned width, uint64_t const * w0, uint64_t const * w1) {
+    coverage_node & dn = d->nodes[i];
+    if (width != dn.width)
+        return;
+    if (!dn.seen) {
+        dn.seen = true;
+        d->seen(dn.width);
+    }
+    for (unsigned k = 0; k < (dn.width + 63) / 64; ++k) {
+        uint64_t n0 = w0[k] & ~d->c0[dn.first + k];
+        uint64_t n1 = w1[k] & ~d->c1[dn.first + k];
+        d->c0[dn.first + k] |= n0;
+        d->c1[dn.first + k] |= n1;
+        d->covered(dn.width, __builtin_popcountll(n0) + __builtin_popcountll(n1));
+    }
+}
+
+// Adds the coverage of src to dst. Both must have registered translations
+// of the same formula.
+Z3_API void coverage_merge(Z3_context dst, Z3_context src) {
+    coverage_store * d = get_coverage(dst);
+    coverage_store * s = get_coverage(src);
+    unsigned n = std::min(d->nodes.size(), s->nodes.size());
+    for (unsigned i = 0; i < n; ++i) {
+        coverage_node const & sn = s->nodes[i];
+        if (sn.seen)
+            add_coverage(d, i, sn.width, &s->c0[sn.first], &s->c1[sn.first]);
+    }
+}
+
+// Appends the coverage of ctx to words: the number of nodes, then for each
+// node its width, whether it was seen, and its words of c0 and of c1.
+Z3_API void coverage_save(Z3_context ctx, std::vector<uint64_t> & words) {
+    coverage_store * s = get_coverage(ctx);
+    words.push_back(s->nodes.size());
+    for (coverage_node const & node : s->nodes) {
+        unsigned n = (node.width + 63) / 64;
+        words.push_back(node.width);
+        words.push_back(node.seen);
+        words.insert(words.end(), s->c0.begin() + node.first, s->c0.begin() + node.first + n);
+        words.insert(words.end(), s->c1.begin() + node.first, s->c1.begin() + node.first + n);
+    }
+}
+
+// Adds to ctx the coverage saved by coverage_save() from a context that
+// registered the same formula.
+Z3_API bool coverage_load(Z3_context ctx, std::vector<uint64_t> const & words) {
+    coverage_store * d = get_coverage(ctx);
+    if (words.empty())
+        return false;
+    size_t p = 1;
+    for (uint64_t i = 0; i < words[0]; ++i) {
+        if (p + 2 > words.size())
+            return false;
+        unsigned width = words[p];
+        bool seen = words[p + 1];
+        unsigned n = (width + 63) / 64;
+        p += 2;
+        if (p + 2 * n > words.size())
+            return false;
+        if (seen && i < d->nodes.size())
+            add_coverage(d, i, width, &words[p], &words[p + n]);
+        p += 2 * n;
+    }
+    return true;
+}
 
-Z3_API int coverage_enable = 0;
-Z3_API int coverage_bool = 0;
-Z3_API int coverage_bv = 0;
-Z3_API int coverage_all_bool = 0;
-Z3_API int coverage_all_bv = 0;
-Z3_API std::unordered_map<app*, coverage> covered;
+// Drops the store of ctx, before the context is deleted.
+Z3_API void coverage_release(Z3_context ctx) {
+    std::lock_guard<std::mutex> lock(coverage_lock);
+    auto res = coverage_stores.find(&mk_c(ctx)->m());
+    if (res == coverage_stores.end())
+        return;
+    if (active_coverage == res->second)
+        active_coverage = nullptr;
+    delete res->second;
+    coverage_stores.erase(res);
+}
 
 Z3_API Z3_ast parse_bv(char const * n, Z3_sort s, Z3_context ctx);
 Z3_API std::string bv_string(Z3_ast ast, Z3_context ctx);
@@ -106,98 +263,57 @@ std::string bv_string(Z3_ast ast, Z3_context ctx) {
     return s;
 }
 
-bool is_zero_bit(numeral & val, unsigned idx) {
-    if (val.is_zero())
-        return true;
-    div(val, rational::power_of_two(idx), val);
-    return (val % numeral(2)).is_zero();
+// Splits the non-negative numeral val into n 64-bit words, least
+// significant first.
+static void numeral_words(numeral val, unsigned n, uint64_t * words) {
+    if (n == 1) {
+        words[0] = val.get_uint64();
+        return;
+    }
+    numeral base = numeral::power_of_two(64);
+    for (unsigned k = 0; k < n; ++k) {
+        numeral q = div(val, base);
+        words[k] = (val - q * base).get_uint64();
+        val = q;
+    }
 }
 
 void process_coverage(expr_ref & m_r, app * t, ast_manager & m) {
-            if (coverage_enable != 2)
+            coverage_store * store = active_coverage;
+            if (!store || store->mode != 2 || &store->m != &m)
                 return;
-            auto res = covered.find(t);
-            if (res == covered.end())
+            unsigned id = t->get_id();
+            if (id >= store->slot.size() || !store->slot[id])
                 return;
             if (!m_r) {
                 return;
             }
-            coverage & cov = res->second;
-            params_ref p;
-            bv_rewriter rewriter(m, p);
-            numeral val;
-            unsigned long value;
-            unsigned sz;
+            coverage_node & cov = store->nodes[store->slot[id] - 1];
+            uint64_t small;
+            uint64_t * value = &small;
+            std::vector<uint64_t> big;
 
             if (m.is_bool(m_r)) {
-                sz = 1;
+                if (cov.width != 1)
+                    return;
                 if (m.is_true(m_r))
-                    value = 1;
+                    small = 1;
                 else if (m.is_false(m_r))
-                    value = 0;
+                    small = 0;
                 else
                     return;
             } else {
-                bv_util util(m);
-
-                if (!util.is_bv(m_r))
-                    return;
-                if (!rewriter.is_numeral(m_r, val, sz))
+                numeral val;
+                unsigned sz;
+                if (!store->bv.is_numeral(m_r, val, sz) || sz != cov.width)
                     return;
-                value = val.get_uint64();
-            }
-            if (cov.b.c0.size() == 0) {
-                if (sz == 1) {
-                    ++coverage_all_bool;
-                } else {
-                    coverage_all_bv += sz;
-                }
-                if (sz <= 64) {
-                    cov.s.c0 = 0;
-                    cov.s.c1 = 0;
-                    cov.b.c0.resize(1, false);
-                    cov.b.c1.resize(1, false);
-                } else {
-                    cov.b.c0.resize(sz, false);
-                    cov.b.c1.resize(sz, false);
-                }
-            }
-            if (sz <= 64) {
-                for (unsigned long j = 0; j < sz; ++j) {
-                    if ((value >> j) & 1) {
-                        if (((cov.s.c1 >> j) & 1) == 0) {
-                            cov.s.c1 |= 1ul << j;
-                            if (sz > 1)
-                                ++coverage_bv;
-                            else
-                                ++coverage_bool;
-                        }
-                    } else {
-                        if (((cov.s.c0 >> j) & 1) == 0) {
-                            cov.s.c0 |= 1ul << j;
-                            if (sz > 1)
-                                ++coverage_bv;
-                            else
-                                ++coverage_bool;
-                        }
-                    }
-                }
-            } else {
-                int cur = coverage_bv;
-                for (int j = 0; j < sz; ++j) {
-                    if (is_zero_bit(val, j)) {
-                        if (!cov.b.c0[j]) {
-                            cov.b.c0[j] = true;
-                            ++coverage_bv;
-                        }
-                    } else {
-                        if (!cov.b.c1[j]) {
-                            cov.b.c1[j] = true;
-                            ++coverage_bv;
-                        }
-                    }
+                if (sz > 64) {
+                    big.resize((sz + 63) / 64);
+                    value = big.data();
                 }
+                numeral_words(val, (sz + 63) / 64, value);
             }
+            store->cover(cov, value);
 }
 
 model::model(ast_manager & m):
@@ -250,20 +366,39 @@ model * model::copy() const {
     return m;
 }
 
-void visit(expr * e) {
-    app * a = to_app(e);
-    coverage cov;
-    auto res = covered.emplace(a, cov);
-    if (!res.second)
-        return;
-    for (int i = 0; i < a->get_num_args(); ++i)
-        visit(a->get_args()[i]);
+// Registers the Bool and bit-vector nodes of e that are not yet in store,
+// in depth-first order.
+void visit(coverage_store & store, expr * e) {
+    ptr_vector<expr> todo;
+    todo.push_back(e);
+    while (!todo.empty()) {
+        expr * n = todo.back();
+        todo.pop_back();
+        unsigned id = n->get_id();
+        if (id >= store.slot.size())
+            store.slot.resize(id + 1, 0);
+        if (store.slot[id] || !is_app(n))
+            continue;
+        app * a = to_app(n);
+        bv_util util(store.m);
+        unsigned width = store.m.is_bool(a) ? 1 : util.is_bv(a) ? util.get_bv_size(a) : 0;
+        coverage_node node;
+        node.first = store.c0.size();
+        node.width = width;
+        node.seen = false;
+        store.nodes.push_back(node);
+        store.slot[id] = store.nodes.size();
+        store.c0.resize(store.c0.size() + (width + 63) / 64, 0);
+        store.c1.resize(store.c1.size() + (width + 63) / 64, 0);
+        for (unsigned i = a->get_num_args(); i > 0; --i)
+            todo.push_back(a->get_arg(i - 1));
+    }
 }
 
 // Remark: eval is for backward compatibility. We should use model_evaluator.
 bool model::eval(expr * e, expr_ref & result, bool model_completion) {
-    if (coverage_enable == 1) {
-        visit(e);
+    if (active_coverage && active_coverage->mode == 1 && &active_coverage->m == &m_manager) {
+        visit(*active_coverage, e);
         return true;
     }
     model_evaluator ev(*this);